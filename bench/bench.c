@@ -0,0 +1,390 @@
+/*
+    Microbenchmarks for the storage engine.
+
+    Builds sqlite.c into the same translation unit and drives the B-tree
+    and pager directly, so REPL parsing and row formatting are not measured.
+    A human-readable table goes to stderr and a JSON report to stdout.
+
+    Usage: bench [--page-size <bytes>] [--direct-io] [rows ...]
+    Row counts default to 10, half the tree's capacity, and its full
+    capacity. Larger counts are reported as skipped until internal nodes
+    can split.
+
+    Cold reads open the db with direct I/O where the file system allows it,
+    so they miss the OS page cache as well as the pager's. Otherwise the
+    report marks them as served from the OS cache.
+*/
+#define DB_NO_MAIN
+#include "../sqlite.c"
+
+const char* BENCH_DB_FILENAME = "bench.db";
+const uint64_t BENCH_MIN_OPS = 200000; // Repeat each workload until this many ops are timed
+const uint64_t BENCH_MIN_COLD_OPS = 20000; // Cold ops go to disk, so fewer are enough
+const uint32_t BENCH_RANGE_SCAN_LENGTH = 10;
+
+uint32_t bench_page_size = DEFAULT_PAGE_SIZE;
+uint32_t bench_pager_flags = 0;
+uint32_t bench_cold_pager_flags = 0;
+
+typedef struct bench_result_t {
+    const char* workload;
+    const char* cache; // "cold", "warm", or "n/a" for inserts
+    uint64_t requested_rows;
+    uint32_t rows;
+    uint64_t ops;
+    uint64_t total_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+} BenchResult;
+
+typedef struct bench_samples_t {
+    uint64_t* latencies_ns;
+    uint64_t len;
+    uint64_t capacity;
+} BenchSamples;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    The tree cannot split internal nodes yet, so a root with
+    INTERNAL_NODE_MAX_CELLS keys caps how many rows any insert order can hold.
+*/
+uint32_t bench_max_rows() {
+    return INTERNAL_NODE_MAX_CELLS * leaf_node_left_split_count(bench_page_size) +
+           leaf_node_max_cells(bench_page_size);
+}
+
+uint32_t bench_random(uint32_t* state) {
+    // xorshift32, deterministic across runs
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void samples_add(BenchSamples* samples, uint64_t latency_ns) {
+    if(samples->len == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->latencies_ns = realloc(samples->latencies_ns, samples->capacity * sizeof(uint64_t));
+    }
+    samples->latencies_ns[samples->len++] = latency_ns;
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+BenchResult summarize(const char* workload, const char* cache, uint64_t requested_rows,
+                      uint32_t rows, BenchSamples* samples) {
+    BenchResult result;
+    result.workload = workload;
+    result.cache = cache;
+    result.requested_rows = requested_rows;
+    result.rows = rows;
+    result.ops = samples->len;
+    result.total_ns = 0;
+    for(uint64_t i = 0; i < samples->len; ++i) {
+        result.total_ns += samples->latencies_ns[i];
+    }
+
+    qsort(samples->latencies_ns, samples->len, sizeof(uint64_t), compare_u64);
+    result.p50_ns = samples->latencies_ns[samples->len * 50 / 100];
+    result.p99_ns = samples->latencies_ns[samples->len * 99 / 100];
+
+    samples->len = 0;
+    return result;
+}
+
+void fill_row(Row* row, uint32_t id) {
+    row->id = id;
+    snprintf(row->username, sizeof(row->username), "user%d", id);
+    snprintf(row->email, sizeof(row->email), "person%d@example.com", id);
+}
+
+Database* open_database(uint32_t pager_flags) {
+    return db_open(BENCH_DB_FILENAME, bench_page_size, pager_flags);
+}
+
+Database* fresh_database() {
+    unlink(BENCH_DB_FILENAME);
+    return open_database(bench_pager_flags);
+}
+
+/*
+    Whether the file system holding the bench db accepts direct I/O. The
+    pager exits if the open fails, so probe with a plain open first.
+*/
+bool direct_io_supported() {
+#if defined(O_DIRECT)
+    int fd = open(BENCH_DB_FILENAME, O_RDWR | O_CREAT | O_DIRECT, S_IWUSR | S_IRUSR);
+    if(fd == -1) {
+        return false;
+    }
+    close(fd);
+    return true;
+#elif defined(F_NOCACHE)
+    return true;
+#else
+    return false;
+#endif
+}
+
+Table* users_table(Database* database) {
+    return database_find_table(database, DEFAULT_TABLE_NAME);
+}
+
+/*
+    Insert keys in the given order into a fresh table, timing each insert.
+*/
+void run_inserts(uint32_t* keys, uint32_t rows, BenchSamples* samples) {
+    Database* database = fresh_database();
+    Table* table = users_table(database);
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+
+    for(uint32_t i = 0; i < rows; ++i) {
+        fill_row(&statement.row_to_insert, keys[i]);
+        uint64_t start = now_ns();
+        execute_insert(&statement, table);
+        samples_add(samples, now_ns() - start);
+    }
+
+    db_close(database);
+}
+
+void build_table(uint32_t rows) {
+    Database* database = fresh_database();
+    Table* table = users_table(database);
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+    for(uint32_t id = 1; id <= rows; ++id) {
+        fill_row(&statement.row_to_insert, id);
+        execute_insert(&statement, table);
+    }
+    db_close(database);
+}
+
+uint32_t point_lookup(Table* table, uint32_t key) {
+    Cursor* cursor = table_find(table, key);
+    uint32_t found = 0;
+    if(cursor_holds_key(cursor, key)) {
+        Row row;
+        deserialize_row(cursor_value(cursor), &row);
+        found = row.id;
+    }
+    free(cursor);
+    return found;
+}
+
+uint32_t scan(Cursor* cursor, uint32_t limit) {
+    Row row;
+    uint32_t count = 0;
+    while(!cursor->end_of_table && count < limit) {
+        deserialize_row(cursor_value(cursor), &row);
+        count++;
+        cursor_advance(cursor);
+    }
+    free(cursor);
+    return count;
+}
+
+/*
+    Time read workloads against a table of the given size. A cold op opens
+    the database first, with bench_cold_pager_flags, so every page is a
+    pager miss; a warm op reuses an open table whose pages are already cached.
+*/
+void run_reads(const char* workload, bool cold, uint32_t rows, BenchSamples* samples) {
+    uint32_t random_state = 2463534242;
+    Database* database = cold ? NULL : open_database(bench_pager_flags);
+    volatile uint32_t sink = 0;
+
+    while(samples->len < (cold ? BENCH_MIN_COLD_OPS : BENCH_MIN_OPS)) {
+        if(cold) {
+            database = open_database(bench_cold_pager_flags);
+        }
+        Table* table = users_table(database);
+
+        uint32_t key = bench_random(&random_state) % rows + 1;
+        uint64_t start = now_ns();
+        if(strcmp(workload, "point_lookup") == 0) {
+            sink += point_lookup(table, key);
+        } else if(strcmp(workload, "full_scan") == 0) {
+            sink += scan(table_start(table), rows);
+        } else {
+            if(rows < BENCH_RANGE_SCAN_LENGTH) {
+                key = 1;
+            } else if(key + BENCH_RANGE_SCAN_LENGTH > rows + 1) {
+                key = rows + 1 - BENCH_RANGE_SCAN_LENGTH;
+            }
+            Cursor* cursor = table_find(table, key);
+            cursor->end_of_table = false;
+            sink += scan(cursor, BENCH_RANGE_SCAN_LENGTH);
+        }
+        samples_add(samples, now_ns() - start);
+
+        if(cold) {
+            db_close(database);
+        }
+    }
+
+    if(!cold) {
+        db_close(database);
+    }
+}
+
+void print_result(BenchResult* result) {
+    double ops_per_sec = result->total_ns ? result->ops * 1e9 / result->total_ns : 0;
+    fprintf(stderr, "%-14s %-14s %10llu %6d %12.0f %10llu %10llu\n",
+            result->workload, result->cache,
+            (unsigned long long)result->requested_rows, result->rows, ops_per_sec,
+            (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+}
+
+void print_skipped(uint64_t requested_rows, const char* reason) {
+    fprintf(stderr, "%-14s %-14s %10llu %6s  skipped: %s\n", "all", "-",
+            (unsigned long long)requested_rows, "-", reason);
+}
+
+void print_skipped_json(uint64_t requested_rows, const char* reason, bool first) {
+    printf("%s    {\"requested_rows\": %llu, \"skipped\": \"%s\"}",
+           first ? "" : ",\n", (unsigned long long)requested_rows, reason);
+}
+
+void print_result_json(BenchResult* result, bool first) {
+    double ops_per_sec = result->total_ns ? result->ops * 1e9 / result->total_ns : 0;
+    printf("%s    {\"workload\": \"%s\", \"cache\": \"%s\", \"requested_rows\": %llu, \"rows\": %d, "
+           "\"ops\": %llu, \"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu}",
+           first ? "" : ",\n",
+           result->workload, result->cache,
+           (unsigned long long)result->requested_rows, result->rows,
+           (unsigned long long)result->ops, ops_per_sec,
+           (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+}
+
+int main(int argc, char* argv[]) {
+    int first_size_arg = 1;
+    while(first_size_arg < argc && strncmp(argv[first_size_arg], "--", 2) == 0) {
+        if(strcmp(argv[first_size_arg], "--direct-io") == 0) {
+            bench_pager_flags |= PAGER_DIRECT_IO;
+            first_size_arg++;
+        } else if(strcmp(argv[first_size_arg], "--page-size") == 0 && first_size_arg + 1 < argc) {
+            bench_page_size = atoi(argv[first_size_arg + 1]);
+            if(!is_valid_page_size(bench_page_size)) {
+                fprintf(stderr, "Page size must be a power of two from %d to %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(1);
+            }
+            first_size_arg += 2;
+        } else {
+            fprintf(stderr, "Unrecognized option [%s]\n", argv[first_size_arg]);
+            exit(1);
+        }
+    }
+
+    uint64_t default_sizes[] = { 10, bench_max_rows() / 2, bench_max_rows() };
+    uint32_t num_sizes = argc > first_size_arg ? argc - first_size_arg : 3;
+    uint64_t* sizes = malloc(sizeof(uint64_t) * num_sizes);
+    for(uint32_t i = 0; i < num_sizes; ++i) {
+        sizes[i] = argc > first_size_arg ? strtoull(argv[first_size_arg + i], NULL, 10) : default_sizes[i];
+        if(sizes[i] == 0) {
+            fprintf(stderr, "Row counts must be positive\n");
+            exit(1);
+        }
+    }
+
+    bench_cold_pager_flags = bench_pager_flags;
+    bool cold_direct_io = (bench_pager_flags & PAGER_DIRECT_IO) || direct_io_supported();
+    if(cold_direct_io) {
+        bench_cold_pager_flags |= PAGER_DIRECT_IO;
+    }
+    const char* cold_label = cold_direct_io ? "cold" : "cold-os-cached";
+
+    const char* read_workloads[] = { "point_lookup", "full_scan", "range_scan" };
+    BenchSamples samples = { NULL, 0, 0 };
+    uint32_t random_state = 88172645;
+    bool first = true;
+
+    fprintf(stderr, "Row counts above %d are skipped: internal node splitting is not implemented\n",
+            bench_max_rows());
+    if(!cold_direct_io) {
+        fprintf(stderr, "Direct I/O is unavailable here, so cold reads are served from the OS page cache\n");
+    }
+    fprintf(stderr, "%-14s %-14s %10s %6s %12s %10s %10s\n",
+            "workload", "cache", "requested", "rows", "ops/sec", "p50 ns", "p99 ns");
+    printf("{\n  \"page_size\": %d,\n  \"direct_io\": %s,\n  \"cold_direct_io\": %s,\n"
+           "  \"max_rows\": %d,\n  \"leaf_node_max_cells\": %d,\n  \"results\": [\n",
+           bench_page_size, (bench_pager_flags & PAGER_DIRECT_IO) ? "true" : "false",
+           cold_direct_io ? "true" : "false", bench_max_rows(), leaf_node_max_cells(bench_page_size));
+
+    for(uint32_t s = 0; s < num_sizes; ++s) {
+        bool duplicate = false;
+        for(uint32_t earlier = 0; earlier < s; ++earlier) {
+            duplicate = duplicate || sizes[earlier] == sizes[s];
+        }
+        if(duplicate) {
+            continue;
+        }
+        if(sizes[s] > bench_max_rows()) {
+            print_skipped(sizes[s], "exceeds tree capacity");
+            print_skipped_json(sizes[s], "exceeds tree capacity", first);
+            first = false;
+            continue;
+        }
+
+        uint32_t rows = sizes[s];
+        uint32_t* keys = malloc(sizeof(uint32_t) * rows);
+        BenchResult result;
+
+        // Sequential insert
+        for(uint32_t i = 0; i < rows; ++i) {
+            keys[i] = i + 1;
+        }
+        while(samples.len < BENCH_MIN_OPS) {
+            run_inserts(keys, rows, &samples);
+        }
+        result = summarize("seq_insert", "n/a", sizes[s], rows, &samples);
+        print_result(&result);
+        print_result_json(&result, first);
+        first = false;
+
+        // Random insert, a fresh shuffle for every table built
+        while(samples.len < BENCH_MIN_OPS) {
+            for(uint32_t i = rows - 1; i > 0; --i) {
+                uint32_t j = bench_random(&random_state) % (i + 1);
+                uint32_t tmp = keys[i];
+                keys[i] = keys[j];
+                keys[j] = tmp;
+            }
+            run_inserts(keys, rows, &samples);
+        }
+        result = summarize("random_insert", "n/a", sizes[s], rows, &samples);
+        print_result(&result);
+        print_result_json(&result, false);
+
+        build_table(rows);
+        for(uint32_t w = 0; w < 3; ++w) {
+            for(uint32_t c = 0; c < 2; ++c) {
+                bool cold = (c == 0);
+                run_reads(read_workloads[w], cold, rows, &samples);
+                result = summarize(read_workloads[w], cold ? cold_label : "warm", sizes[s], rows, &samples);
+                print_result(&result);
+                print_result_json(&result, false);
+            }
+        }
+
+        free(keys);
+    }
+
+    printf("\n  ]\n}\n");
+    unlink(BENCH_DB_FILENAME);
+    free(samples.latencies_ns);
+    free(sizes);
+    return 0;
+}
@@ -1,10 +1,13 @@
+require 'fileutils'
+require 'socket'
+
 describe 'database' do
     before do
-        `rm -rf test.db`
+        `rm -rf test.db test.sock backup.db other.db other.db.tmp`
     end
-    def run_script(commands)
+    def run_script(commands, args = "", filename = "test.db")
         raw_output = nil
-        IO.popen("./db test.db", "r+") do |pipe|
+        IO.popen("./db #{filename} #{args}", "r+") do |pipe|
             commands.each do |command|
                 begin
                     pipe.puts command
@@ -20,6 +23,24 @@ describe 'database' do
         raw_output.split("\n")
     end
 
+    def with_server(stop_signal = "TERM")
+        pid = spawn("./db test.db --server test.sock", out: File::NULL)
+        50.times do
+            break if File.socket?("test.sock")
+            sleep 0.05
+        end
+        yield
+    ensure
+        Process.kill(stop_signal, pid)
+        Process.wait(pid)
+    end
+
+    def send_request(socket, command)
+        socket.write([command.bytesize].pack("L") + command)
+        length = socket.read(4).unpack1("L")
+        socket.read(length)
+    end
+
     it 'inserts and retrieves a row' do
         result = run_script([
             "insert 1 user1 person1@example.com",
@@ -35,14 +56,19 @@ describe 'database' do
     end
 
     it 'prints an error message when table is full' do
-        script = (1..1401).map do |i|
+        script = (1..36).map do |i|
             "insert #{i} user#{i} person#{i}@example.com"
         end
+        script << "select where id = 34"
         script << ".exit"
         result = run_script(script)
-        expect(result.last(2)).to eq([
+        expect(result.last(6)).to eq([
             'db > Executed',
-            'db > Need to implement splitting internal node'
+            'db > Error: Table full',
+            'db > Error: Table full',
+            'db > (34, user34, person34@example.com)',
+            'Executed',
+            'db > ',
         ])
     end
 
@@ -313,4 +339,549 @@ describe 'database' do
         #   "db >"
         # ])
     end
-end
\ No newline at end of file
+
+    it 'serves statements from several clients over a unix socket' do
+        with_server do
+            client1 = UNIXSocket.new("test.sock")
+            client2 = UNIXSocket.new("test.sock")
+            expect(send_request(client1, "insert 1 user1 person1@example.com")).to eq("Executed\n")
+            expect(send_request(client2, "insert 2 user2 person2@example.com")).to eq("Executed\n")
+            expect(send_request(client1, "insert 2 user2 person2@example.com")).to eq("Error: Duplicate key\n")
+            expect(send_request(client2, "select")).to eq(
+                "(1, user1, person1@example.com)\n(2, user2, person2@example.com)\nExecuted\n"
+            )
+            client1.close
+            client2.close
+        end
+
+        result = run_script([
+            "select",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > (1, user1, person1@example.com)",
+            "(2, user2, person2@example.com)",
+            "Executed",
+            "db > ",
+        ])
+    end
+
+    it 'persists each server request before answering it' do
+        with_server("KILL") do
+            client = UNIXSocket.new("test.sock")
+            (1..34).each do |i|
+                expect(send_request(client, "insert #{i} user#{i} person#{i}@example.com")).to eq("Executed\n")
+            end
+            expect(send_request(client, "insert 35 user35 person35@example.com")).to eq("Error: Table full\n")
+            expect(send_request(client, "select where id = 34")).to eq("(34, user34, person34@example.com)\nExecuted\n")
+            client.close
+        end
+
+        result = run_script([
+            "select id where id = 34",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > (34)",
+            "Executed",
+            "db > ",
+        ])
+    end
+
+    it 'prints b-tree counters in stats' do
+        script = (1..14).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".stats"
+        script << ".exit"
+        result = run_script(script)
+
+        btree = result.index("B-tree:")
+        expect(result[btree, 8]).to eq([
+            "B-tree:",
+            "  depth: 2",
+            "  leaf nodes: 2",
+            "  internal nodes: 1",
+            "  average leaf fill: 53.8%",
+            "  leaf splits: 1",
+            "  root splits: 1",
+            "Latency (us):",
+        ])
+        expect(result[btree + 8]).to start_with("  insert: count 14,")
+    end
+
+    it 'selects a single row by id' do
+        script = (1..15).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << "select where id = 12"
+        script << "select where id = 16"
+        script << "select where id"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result[15...result.length]).to eq([
+            "db > (12, user12, person12@example.com)",
+            "Executed",
+            "db > Executed",
+            "db > Syntax error. Could not parse statement",
+            "db > ",
+        ])
+    end
+
+    it 'detects duplicate keys below the root' do
+        script = (1..15).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << "insert 12 user12 person12@example.com"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result.last(2)).to eq([
+            "db > Error: Duplicate key",
+            "db > ",
+        ])
+    end
+
+    it 'writes a file header and rejects files without one' do
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        header = File.binread("test.db", 28)
+        expect(header[0, 16]).to eq("sqlite clone db\0")
+        expect(header[16, 12].unpack("LLL")).to eq([5, 2, 4096])
+
+        File.binwrite("test.db", "x" * 4096)
+        result = run_script([".exit"])
+        expect(result).to eq([
+            "Db file has no valid header. Corrupt file",
+        ])
+    end
+
+    it 'upgrades a file written before the header existed' do
+        # A lone root leaf on page 0: type, is_root, parent, num_cells, next_leaf, then one cell
+        cell = [1, 1].pack("LL") + "user1".ljust(33, "\0") + "person1@example.com".ljust(256, "\0")
+        page = [1, 1, 0, 1, 0].pack("CCLLL") + cell
+        File.binwrite("test.db", page.ljust(4096, "\0"))
+
+        result = run_script([
+            "insert 2 user2 person2@example.com",
+            "select",
+            ".tables",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > Executed",
+            "db > (1, user1, person1@example.com)",
+            "(2, user2, person2@example.com)",
+            "Executed",
+            "db > users (id, username, email) root page 1",
+            "db > ",
+        ])
+        expect(File.binread("test.db", 16)).to eq("sqlite clone db\0")
+        expect(File.size("test.db")).to eq(2 * 4096)
+    end
+
+    it 'rejects a header with format version 0' do
+        run_script([".exit"])
+        File.binwrite("test.db", [0].pack("L"), 16)
+        result = run_script([".exit"])
+        expect(result).to eq([
+            "Unsupported db file format version 0",
+        ])
+    end
+
+    it 'uses the page size chosen when the file was created' do
+        script = (1..14).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".exit"
+        run_script(script, "--page-size 16384")
+        expect(File.size("test.db")).to eq(2 * 16384)
+
+        result = run_script([
+            ".constants",
+            ".btree",
+            ".exit",
+        ])
+        expect(result[5, 4]).to eq([
+            "LEAF_NODE_SPACE_FOR_CELLS: 16370",
+            "LEAF_NODE_MAX_CELLS: 55",
+            "db > Tree:",
+            "- leaf (size 14)",
+        ])
+    end
+
+    it 'rejects invalid page sizes' do
+        result = run_script([".exit"], "--page-size 1000")
+        expect(result).to eq([
+            "Page size must be a power of two from 4096 to 65536",
+        ])
+    end
+
+    it 'persists data with direct io' do
+        script = (1..15).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".exit"
+        run_script(script, "--direct-io")
+
+        result = run_script([
+            "select where id = 15",
+            ".exit",
+        ], "--direct-io")
+        expect(result).to eq([
+            "db > (15, user15, person15@example.com)",
+            "Executed",
+            "db > ",
+        ])
+    end
+
+    it 'orders rows by a non-key column' do
+        script = [
+            "insert 1 carol carol@example.com",
+            "insert 2 alice zed@example.com",
+            "insert 3 bob bob@example.com",
+            "insert 4 alice alice@example.com",
+            "select order by username",
+            "select order by email desc limit 2",
+            "select order by id",
+            ".exit",
+        ]
+        result = run_script(script)
+
+        expect(result[4...result.length]).to eq([
+            "db > (2, alice, zed@example.com)",
+            "(4, alice, alice@example.com)",
+            "(3, bob, bob@example.com)",
+            "(1, carol, carol@example.com)",
+            "Executed",
+            "db > (2, alice, zed@example.com)",
+            "(1, carol, carol@example.com)",
+            "Executed",
+            "db > Syntax error. Could not parse statement",
+            "db > ",
+        ])
+    end
+
+    it 'spills sorted runs and merges them in several passes' do
+        script = (1..20).map do |i|
+            "insert #{i} user#{(i * 7) % 20} person#{i}@example.com"
+        end
+        script << "select id order by username desc"
+        script << "select limit x"
+        script << ".stats"
+        script << ".exit"
+        result = run_script(script, "--sort-memory-rows 3 --sort-fan-in 2")
+
+        # 7 runs of at most 3 rows take three merge passes at fan-in 2
+        ids = [7, 4, 1, 18, 15, 12, 9, 6, 17, 14, 11, 8, 5, 2, 19, 16, 13, 10, 3, 20]
+        expect(result[20, 23]).to eq(
+            ["db > (#{ids[0]})"] + ids[1..-1].map { |id| "(#{id})" } + [
+            "Executed",
+            "db > Syntax error. Could not parse statement",
+            "db > Pager:",
+        ])
+        expect(result).to include("  runs spilled: 7")
+    end
+
+    it 'merges runs during the scan so open temp files stay few' do
+        script = (1..34).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".exit"
+        run_script(script)
+
+        # 34 one-row runs would need 34 temp files open at once
+        output = IO.popen(["sh", "-c", "ulimit -n 12 && exec ./db test.db --sort-memory-rows 1 --sort-fan-in 2"], "r+") do |pipe|
+            pipe.puts "select id order by email desc"
+            pipe.puts ".exit"
+            pipe.close_write
+            pipe.gets(nil)
+        end
+        ids = (1..34).sort_by { |i| "person#{i}@example.com" }.reverse
+        expect(output.split("\n")).to eq(
+            ["db > (#{ids[0]})"] + ids[1..-1].map { |id| "(#{id})" } + ["Executed", "db > "])
+    end
+
+    it 'backs up the open database and then only changed pages' do
+        script = (1..14).map do |i|
+            "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".backup backup.db"
+        script << "insert 15 user15 person15@example.com"
+        script << ".backup incremental backup.db"
+        script << ".backup incremental backup.db"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result[14...result.length]).to eq([
+            "db > Copied 4 of 4 pages to backup.db",
+            "db > Executed",
+            "db > Copied 2 of 4 pages to backup.db",
+            "db > Copied 1 of 4 pages to backup.db",
+            "db > ",
+        ])
+
+        FileUtils.mv("backup.db", "test.db")
+        result = run_script([
+            "select where id = 15",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > (15, user15, person15@example.com)",
+            "Executed",
+            "db > ",
+        ])
+    end
+
+    it 'refuses to back up the database onto itself' do
+        result = run_script([
+            "insert 1 user1 person1@example.com",
+            ".backup test.db",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > Executed",
+            "db > Error: Cannot back up the database onto itself",
+            "db > ",
+        ])
+        result = run_script([
+            "select",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > (1, user1, person1@example.com)",
+            "Executed",
+            "db > ",
+        ])
+        expect(File.exist?("test.db.tmp")).to eq(false)
+    end
+
+    it 'refuses an incremental backup onto a different file' do
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".backup backup.db",
+            ".exit",
+        ])
+        `rm -rf test.db`
+        # Both databases are now at backup generation 1
+        result = run_script([
+            "insert 1 user1 person1@example.com",
+            ".backup incremental backup.db",
+            ".backup other.db",
+            ".backup incremental backup.db",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > Executed",
+            "db > Error: backup.db is not the latest backup of this database",
+            "db > Copied 2 of 2 pages to other.db",
+            "db > Error: backup.db is not the latest backup of this database",
+            "db > ",
+        ])
+    end
+
+    it 'refuses a backup whose temp file is the database' do
+        result = run_script([
+            "insert 1 user1 person1@example.com",
+            ".backup other.db",
+            ".exit",
+        ], "", "other.db.tmp")
+        expect(result).to eq([
+            "db > Executed",
+            "db > Error: Cannot back up the database onto itself",
+            "db > ",
+        ])
+        expect(File.exist?("other.db")).to eq(false)
+        expect(File.size("other.db.tmp")).to eq(2 * 4096)
+    end
+
+    it 'gives a version 4 file a database id' do
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        # Rewrite as version 4: no database id, catalog right after the free page head
+        page = File.binread("test.db", 4096)
+        id_offset = 16 + 4 * 4 + 13 + 4
+        page[16, 4] = [4].pack("L")
+        page = page[0, id_offset] + page[id_offset + 8, 4096 - id_offset - 8] + "\0" * 8
+        File.binwrite("test.db", page, 0)
+
+        result = run_script([
+            ".tables",
+            "select",
+            ".backup backup.db",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > users (id, username, email) root page 1",
+            "db > (1, user1, person1@example.com)",
+            "Executed",
+            "db > Copied 2 of 2 pages to backup.db",
+            "db > ",
+        ])
+        expect(File.binread("test.db", 4, 16).unpack1("L")).to eq(5)
+    end
+
+    it 'filters rows on username and email across leaves' do
+        script = (1..30).map do |i|
+            domain = i % 3 == 0 ? "test.org" : "example.com"
+            "insert #{i} user#{i} person#{i}@#{domain}"
+        end
+        script << "select where username = user21"
+        script << "select id where email like 'person2%'"
+        script << "select id, email where email contains test limit 3"
+        script << "select where email like 'person%x'"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result[30...result.length]).to eq([
+            "db > (21, user21, person21@test.org)",
+            "Executed",
+            "db > (2)",
+            "(20)",
+            "(21)",
+            "(22)",
+            "(23)",
+            "(24)",
+            "(25)",
+            "(26)",
+            "(27)",
+            "(28)",
+            "(29)",
+            "Executed",
+            "db > (3, person3@test.org)",
+            "(6, person6@test.org)",
+            "(9, person9@test.org)",
+            "Executed",
+            "db > Syntax error. Could not parse statement",
+            "db > ",
+        ])
+    end
+
+    it 'matches literal percent signs and needles past the vector head' do
+        result = run_script([
+            "insert 1 alice 100%off@example.com",
+            "insert 2 bob averyveryverylongname@example.com",
+            "insert 3 carol averyveryverylongname@example.org",
+            "select id where email = 100%off@example.com",
+            "select id where email contains %off",
+            "select id where email = averyveryverylongname@example.com",
+            "select id where email like averyveryverylongname@example.o%",
+            "select id where email like 100%off%",
+            ".exit",
+        ])
+        expect(result[3...result.length]).to eq([
+            "db > (1)",
+            "Executed",
+            "db > (1)",
+            "Executed",
+            "db > (2)",
+            "Executed",
+            "db > (3)",
+            "Executed",
+            "db > Syntax error. Could not parse statement",
+            "db > ",
+        ])
+    end
+
+    it 'projects columns on sorted selects' do
+        result = run_script([
+            "insert 1 carol carol@example.com",
+            "insert 2 alice alice@example.com",
+            "insert 3 bob bob@test.org",
+            "select username where email like '%example.com' order by username",
+            "select username where email contains example order by username desc",
+            ".exit",
+        ])
+        expect(result[3...result.length]).to eq([
+            "db > Syntax error. Could not parse statement",
+            "db > (carol)",
+            "(alice)",
+            "Executed",
+            "db > ",
+        ])
+    end
+
+    it 'keeps named tables in one file' do
+        run_script([
+            "create table orders",
+            "insert into orders 1 widget widget@example.com",
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        result = run_script([
+            ".tables",
+            "select from orders",
+            "select username",
+            "create table orders",
+            "select from missing",
+            "create table bad-name",
+            "create table json",
+            ".exit",
+        ])
+        expect(result).to eq([
+            "db > users (id, username, email) root page 1",
+            "orders (id, username, email) root page 2",
+            "db > (1, widget, widget@example.com)",
+            "Executed",
+            "db > (user1)",
+            "Executed",
+            "db > Error: Table orders already exists",
+            "db > Error: No such table missing",
+            "db > Syntax error. Could not parse statement",
+            "db > Syntax error. Could not parse statement",
+            "db > ",
+        ])
+    end
+
+    it 'reuses the pages of a dropped table' do
+        script = ["create table scratch"]
+        script += (1..20).map do |i|
+            "insert into scratch #{i} user#{i} person#{i}@example.com"
+        end
+        script << "drop table scratch"
+        script << "create table kept"
+        script += (1..20).map do |i|
+            "insert into kept #{i} user#{i} person#{i}@example.com"
+        end
+        script << "select from scratch"
+        script << "select id from kept limit 1"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result[-4...result.length]).to eq([
+            "db > Error: No such table scratch",
+            "db > (1)",
+            "Executed",
+            "db > ",
+        ])
+        # Header, users, and the 3 pages scratch used, which kept reuses
+        expect(File.size("test.db")).to eq(5 * 4096)
+    end
+
+    it 'refuses to create a table once every page is in use' do
+        script = []
+        (1..30).each do |t|
+            script << "create table t#{t}"
+            script += (1..34).map do |i|
+                "insert into t#{t} #{i} user#{i} person#{i}@example.com"
+            end
+        end
+        script << "insert 1 user1 person1@example.com"
+        script << "select from users"
+        script << ".exit"
+        result = run_script(script)
+
+        expect(result).to include("db > Error: Database full")
+        expect(result.last(3)).to eq([
+            "db > (1, user1, person1@example.com)",
+            "Executed",
+            "db > ",
+        ])
+        expect(File.size("test.db")).to eq(100 * 4096)
+    end
+end
@@ -1,3 +1,6 @@
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t for pread/pwrite on 32-bit platforms
+#define _GNU_SOURCE // O_DIRECT on Linux
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -5,13 +8,110 @@
 #include <fcntl.h>
 #include <sys/errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 const uint32_t COLUMN_EMAIL_SIZE = 255;
 const uint32_t COLUMN_USERNAME_SIZE = 32;
-const uint32_t PAGE_SIZE = 4096;
+const uint32_t DEFAULT_PAGE_SIZE = 4096;
+const uint32_t MIN_PAGE_SIZE = 4096;
+const uint32_t MAX_PAGE_SIZE = 65536;
+const uint32_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 const uint32_t TABLE_MAX_PAGES = 100;
+const uint32_t LATENCY_HISTOGRAM_BUCKETS = 24; // Bucket i counts latencies below 2^i microseconds
+
+/*
+    ORDER BY. Set with --sort-memory-rows and --sort-fan-in.
+*/
+uint32_t sort_memory_rows = 16384; // Rows held in memory before a sorted run is spilled (~4.6 MiB)
+uint32_t sort_merge_fan_in = 64; // Max runs merged at once; more runs take extra merge passes
+const uint32_t SORT_BUFFER_INITIAL_ROWS = 64; // Sort buffers start this small and grow as rows arrive
+
+/*
+    Predicate scans
+*/
+const uint32_t PREDICATE_HEAD_SIZE = 16; // Leading column bytes compared in one vector op
+const uint32_t PREDICATE_BATCH_SIZE = 64; // Cells evaluated per match bitmap
+
+/*
+    Server mode
+*/
+const uint32_t SERVER_NUM_WORKERS = 4;
+const uint32_t SERVER_MAX_CONNECTIONS = 64;
+const uint32_t SERVER_MAX_REQUEST_SIZE = 4096;
+const uint32_t SERVER_IO_TIMEOUT_SECONDS = 5; // A client stalled mid-request or mid-response for this long is dropped
+
+/*
+    File Header layout. Page 0 holds the header and the catalog; a new
+    file's "users" table has its root at page 1.
+*/
+const char* FILE_HEADER_MAGIC = "sqlite clone db";
+const uint32_t FILE_HEADER_MAGIC_SIZE = 16;
+const uint32_t FILE_HEADER_MAGIC_OFFSET = 0;
+const uint32_t FILE_HEADER_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t FILE_HEADER_VERSION_OFFSET = FILE_HEADER_MAGIC_OFFSET + FILE_HEADER_MAGIC_SIZE;
+const uint32_t FILE_HEADER_PAGE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t FILE_HEADER_PAGE_COUNT_OFFSET = FILE_HEADER_VERSION_OFFSET + FILE_HEADER_VERSION_SIZE;
+const uint32_t FILE_HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t FILE_HEADER_PAGE_SIZE_OFFSET = FILE_HEADER_PAGE_COUNT_OFFSET + FILE_HEADER_PAGE_COUNT_SIZE;
+const uint32_t FILE_HEADER_BACKUP_GENERATION_SIZE = sizeof(uint32_t);
+const uint32_t FILE_HEADER_BACKUP_GENERATION_OFFSET = FILE_HEADER_PAGE_SIZE_OFFSET + FILE_HEADER_PAGE_SIZE_SIZE;
+const uint32_t FILE_HEADER_CHANGED_PAGES_SIZE = (TABLE_MAX_PAGES + 7) / 8; // Bitmap, one bit per page
+const uint32_t FILE_HEADER_CHANGED_PAGES_OFFSET = FILE_HEADER_BACKUP_GENERATION_OFFSET + FILE_HEADER_BACKUP_GENERATION_SIZE;
+const uint32_t FILE_HEADER_FREE_PAGE_HEAD_SIZE = sizeof(uint32_t); // First page of the free list, 0 if empty
+const uint32_t FILE_HEADER_FREE_PAGE_HEAD_OFFSET = FILE_HEADER_CHANGED_PAGES_OFFSET + FILE_HEADER_CHANGED_PAGES_SIZE;
+const uint32_t FILE_HEADER_DATABASE_ID_SIZE = sizeof(uint64_t); // Random, chosen when the file is created
+const uint32_t FILE_HEADER_DATABASE_ID_OFFSET = FILE_HEADER_FREE_PAGE_HEAD_OFFSET + FILE_HEADER_FREE_PAGE_HEAD_SIZE;
+const uint32_t FILE_HEADER_SIZE = FILE_HEADER_MAGIC_SIZE + FILE_HEADER_VERSION_SIZE + FILE_HEADER_PAGE_COUNT_SIZE +
+                                  FILE_HEADER_PAGE_SIZE_SIZE + FILE_HEADER_BACKUP_GENERATION_SIZE +
+                                  FILE_HEADER_CHANGED_PAGES_SIZE + FILE_HEADER_FREE_PAGE_HEAD_SIZE +
+                                  FILE_HEADER_DATABASE_ID_SIZE;
+/*
+    Version 1 had no page size field and always used 4096.
+    Version 2 had no backup generation or changed-page bitmap.
+    Version 3 had no free list or catalog; its one table was rooted at page 1.
+    Version 4 had no database id; its catalog started where the id is now.
+*/
+const uint32_t FILE_FORMAT_VERSION = 5;
+const uint32_t HEADER_PAGE_NUM = 0;
+
+/*
+    Catalog layout. Follows the file header on page 0, one fixed-size entry
+    per table.
+*/
+const uint32_t TABLE_NAME_MAX_LENGTH = 31;
+const char* DEFAULT_TABLE_NAME = "users"; // Used by statements that don't name a table
+const uint32_t DEFAULT_TABLE_ROOT_PAGE_NUM = 1;
+const uint32_t CATALOG_MAX_TABLES = 32;
+const uint32_t CATALOG_NUM_TABLES_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_NUM_TABLES_OFFSET = FILE_HEADER_SIZE;
+const uint32_t CATALOG_HEADER_SIZE = CATALOG_NUM_TABLES_SIZE;
+const uint32_t CATALOG_ENTRY_NAME_SIZE = TABLE_NAME_MAX_LENGTH + 1;
+const uint32_t CATALOG_ENTRY_NAME_OFFSET = 0;
+const uint32_t CATALOG_ENTRY_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_ROOT_PAGE_OFFSET = CATALOG_ENTRY_NAME_OFFSET + CATALOG_ENTRY_NAME_SIZE;
+const uint32_t CATALOG_ENTRY_SCHEMA_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_SCHEMA_OFFSET = CATALOG_ENTRY_ROOT_PAGE_OFFSET + CATALOG_ENTRY_ROOT_PAGE_SIZE;
+const uint32_t CATALOG_ENTRY_SIZE = CATALOG_ENTRY_NAME_SIZE + CATALOG_ENTRY_ROOT_PAGE_SIZE + CATALOG_ENTRY_SCHEMA_SIZE;
+// CATALOG_HEADER_SIZE + CATALOG_MAX_TABLES * CATALOG_ENTRY_SIZE must fit in MIN_PAGE_SIZE after the file header
+
+/*
+    Free page layout. Pages of dropped tables are chained through their first word.
+*/
+const uint32_t FREE_PAGE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREE_PAGE_NEXT_OFFSET = 0;
 
 /*
     Common Node Header layout
@@ -52,7 +152,11 @@ typedef enum meta_command_result_t {
 typedef enum execute_result_t {
     EXECUTE_TABLE_FULL,
     EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_NO_SUCH_TABLE,
+    EXECUTE_TABLE_EXISTS,
+    EXECUTE_CATALOG_FULL,
+    EXECUTE_DATABASE_FULL
 } ExecuteResult;
 
 typedef enum prepare_result_t {
@@ -63,43 +167,166 @@ typedef enum prepare_result_t {
     PREPARE_STRING_TOO_LONG
 } PrepareResult;
 
+typedef enum pager_flag_t {
+    PAGER_DIRECT_IO = 1 << 0, // Bypass the OS page cache; the frame arena is the only cache
+    PAGER_HUGE_PAGES = 1 << 1 // Ask for transparent huge pages backing the frame arena
+} PagerFlag;
+
 typedef enum node_type_t {
     NODE_INTERNAL, NODE_LEAF
 } NodeType;
 
 typedef enum prepared_type_t {
-    STATEMENT_INSERT, STATEMENT_SELECT
+    STATEMENT_INSERT, STATEMENT_SELECT, STATEMENT_CREATE_TABLE, STATEMENT_DROP_TABLE
 } StatementType;
 
+// Row layouts a catalog entry can name. Every table uses the users layout so far.
+typedef enum table_schema_t {
+    SCHEMA_USERS = 1 // (id, username, email)
+} TableSchema;
+
+typedef enum order_column_t {
+    ORDER_NONE, ORDER_BY_USERNAME, ORDER_BY_EMAIL
+} OrderColumn;
+
+typedef enum column_t {
+    COLUMN_ID = 1 << 0,
+    COLUMN_USERNAME = 1 << 1,
+    COLUMN_EMAIL = 1 << 2,
+    COLUMN_ALL = COLUMN_ID | COLUMN_USERNAME | COLUMN_EMAIL
+} Column;
+
+typedef enum predicate_op_t {
+    PREDICATE_NONE,
+    PREDICATE_EQUALS, // where <column> = value
+    PREDICATE_PREFIX, // where <column> like 'value%'
+    PREDICATE_CONTAINS // where <column> contains value
+} PredicateOp;
+
 typedef struct input_buffer_t {
     char* buffer;
     size_t buffer_len;
     ssize_t input_len;
 } InputBuffer;
 
+typedef struct pager_stats_t {
+    uint64_t page_hits;
+    uint64_t page_misses;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t flushes;
+} PagerStats;
+
+typedef struct latency_histogram_t {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+} LatencyHistogram;
+
+typedef struct table_stats_t {
+    uint64_t leaf_splits;
+    uint64_t root_splits; // Internal nodes only come from splitting the root so far
+    uint64_t sort_runs_spilled;
+    LatencyHistogram insert_latency;
+    LatencyHistogram select_latency;
+} TableStats;
+
+// Computed on demand by walking the tree.
+typedef struct tree_stats_t {
+    uint32_t depth;
+    uint32_t num_leaves;
+    uint32_t num_internal_nodes;
+    uint64_t num_cells;
+} TreeStats;
+
 typedef struct pager_t {
     int file_descriptor;
-    uint32_t file_length;
+    uint64_t file_length;
+    uint32_t page_size;
     uint32_t num_pages;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t flags; // PagerFlag bits
+    void* frames; // TABLE_MAX_PAGES page-aligned frames; page n always lives in frame n
+    size_t frames_size;
+    void *pages[TABLE_MAX_PAGES]; // Frames that have been loaded, NULL otherwise
+    uint8_t* changed_pages; // Bitmap of pages modified since the last .backup
+    uint8_t* dirty_pages; // Bitmap of pages modified since they were last written to the db file
+    uint32_t backup_generation; // Matches the header of the last backup taken
+    PagerStats stats;
 } Pager;
 
 typedef struct table_t {
     Pager* pager;
     uint32_t root_page_num;
+    TableStats stats;
 } Table;
 
+/*
+    Every table in one file, sharing a single Pager. tables[i] is the open
+    handle for catalog entry i.
+*/
+typedef struct database_t {
+    Pager* pager;
+    uint32_t num_tables;
+    Table* tables[CATALOG_MAX_TABLES];
+} Database;
+
 typedef struct row_t {
     uint32_t id;
     char username[COLUMN_USERNAME_SIZE + 1];
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+/*
+    A filter on username or email, evaluated against serialized cells so
+    rows that don't match are never deserialized.
+*/
+typedef struct predicate_t {
+    PredicateOp op;
+    uint32_t column_offset; // Offset of the column within a serialized row
+    uint32_t column_size;
+    uint32_t needle_len;
+    uint32_t match_len; // Leading column bytes that must equal needle; includes the NUL for PREDICATE_EQUALS
+    char needle[COLUMN_EMAIL_SIZE + 1 + PREDICATE_HEAD_SIZE]; // Zero padded so head loads stay in bounds
+} Predicate;
+
 typedef struct statement_t {
     StatementType type;
+    char table_name[TABLE_NAME_MAX_LENGTH + 1];
     Row row_to_insert;
+    uint32_t columns; // Column bits to print for a select
+    Predicate predicate;
+    bool select_by_id; // "select where id = N"
+    uint32_t select_id;
+    OrderColumn order_by;
+    bool order_descending;
+    bool has_limit;
+    uint32_t limit;
 } Statement;
 
+/*
+    A single listening socket shared by a pool of workers. The event loop
+    polls idle connections and hands a readable one to a worker, which
+    answers one request and passes the connection back through wake_pipe.
+*/
+typedef struct server_t {
+    Database* database;
+    pthread_mutex_t database_lock; // Serializes statements against the shared tables and Pager
+    int listen_fd;
+    int wake_pipe[2];
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_ready;
+    int* queue; // Ring buffer of readable client fds
+    uint32_t queue_head;
+    uint32_t queue_len;
+    bool shutting_down;
+} Server;
+
+// Sent from a worker to the event loop when it is done with a connection.
+typedef struct server_handoff_t {
+    int fd;
+    bool keep_open;
+} ServerHandoff;
+
 typedef struct cursor_t {
     Table* table;
     uint32_t page_num;
@@ -123,8 +350,7 @@ const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+// Space for cells and max cells depend on the page size; see leaf_node_max_cells().
 
 /*
     Internal Node Body Layout
@@ -134,26 +360,60 @@ const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
 
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
-
 void print_prompt();
 void read_input(InputBuffer* buffer);
-MetaCommandResult do_meta_command(InputBuffer* buffer, Table* table);
+MetaCommandResult do_meta_command(InputBuffer* buffer, Database* database, FILE* out);
 InputBuffer* new_input_buffer();
 PrepareResult prepare_statement(InputBuffer* buffer, Statement* statement);
-ExecuteResult execute_statement(Statement* statement, Table* table);
+PrepareResult prepare_select(InputBuffer* buffer, Statement* statement);
+PrepareResult prepare_table_statement(InputBuffer* buffer, Statement* statement);
+PrepareResult prepare_table_name(char* name, Statement* statement);
+ExecuteResult execute_statement(Statement* statement, Database* database, FILE* out);
+ExecuteResult execute_create_table(Statement* statement, Database* database);
+ExecuteResult execute_drop_table(Statement* statement, Database* database);
 void serialize_row(Row* source, void* destination);
 void deserialize_row(void* source, Row* destination);
+void deserialize_columns(void* source, Row* destination, uint32_t columns);
+PrepareResult prepare_predicate(char* column, char* op, char* value, Predicate* predicate);
+bool cell_matches(void* value, Predicate* predicate);
+bool column_head_matches(const char* column, Predicate* predicate);
+uint64_t leaf_node_match_mask(void* node, uint32_t first_cell, uint32_t num_cells, Predicate* predicate);
+ExecuteResult execute_select_scan(Statement* statement, Table* table, FILE* out);
+void print_projected_row(Row* row, uint32_t columns, FILE* out);
 void* cursor_value(Cursor* cursor);
-ExecuteResult execute_select(Statement* statement, Table* table);
+bool cursor_holds_key(Cursor* cursor, uint32_t key);
+ExecuteResult execute_select(Statement* statement, Table* table, FILE* out);
 ExecuteResult execute_insert(Statement* statement, Table* table);
-Table* db_open(const char* filename);
-void print_row(Row* row);
-Pager* pager_open(const char* filename);
+ExecuteResult execute_select_top_n(Statement* statement, Table* table, FILE* out);
+ExecuteResult execute_select_sorted(Statement* statement, Table* table, FILE* out);
+int compare_rows(const Row* a, const Row* b, OrderColumn column, bool descending);
+int (*row_comparator(OrderColumn column, bool descending))(const void*, const void*);
+void heap_sift_up(Row* heap, uint32_t index, Statement* statement);
+void heap_sift_down(Row* heap, uint32_t len, uint32_t index, Statement* statement);
+FILE* spill_run(Row* rows, uint32_t num_rows);
+FILE* new_sort_run();
+uint32_t add_sort_run(FILE** runs, uint32_t* levels, uint32_t num_runs, FILE* run, Statement* statement);
+void merge_runs(FILE** runs, uint32_t num_runs, Statement* statement, FILE* run_out, FILE* out);
+Database* db_open(const char* filename, uint32_t page_size, uint32_t pager_flags);
+Table* table_open(Pager* pager, uint32_t root_page_num);
+Table* database_find_table(Database* database, const char* name);
+void print_tables(Database* database, FILE* out);
+void print_row(Row* row, FILE* out);
+Pager* pager_open(const char* filename, uint32_t page_size, uint32_t flags);
+int open_db_file(const char* filename, uint32_t flags);
+bool is_legacy_db_file(int fd, off_t file_length);
+void upgrade_legacy_db_file(const char* filename, off_t file_length);
+void shift_legacy_page_numbers(void* node);
+void* allocate_frames(uint32_t page_size, uint32_t flags, size_t* size);
+bool is_valid_page_size(uint32_t page_size);
+uint32_t leaf_node_space_for_cells(uint32_t page_size);
+uint32_t leaf_node_max_cells(uint32_t page_size);
+uint32_t leaf_node_right_split_count(uint32_t page_size);
+uint32_t leaf_node_left_split_count(uint32_t page_size);
 void* get_page(Pager* pager, uint32_t page_num);
-void db_close(Table* table);
+void db_close(Database* database);
 void pager_flush(Pager* pager, uint32_t page_num);
+void pager_fsync(Pager* pager);
 Cursor* table_start(Table* table);
 void cursor_advance(Cursor* cursor);
 uint32_t* leaf_node_num_cells(void* node);
@@ -162,15 +422,17 @@ uint32_t* leaf_node_key(void* node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
 void initialize_leaf_node(void* node);
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
-void print_constants();
-void indent(uint32_t level);
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+void print_constants(Pager* pager, FILE* out);
+void indent(uint32_t level, FILE* out);
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level, FILE* out);
 Cursor* table_find(Table* table, uint32_t key);
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
 NodeType get_node_type(void* node);
 void set_node_type(void* node, NodeType type);
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
 uint32_t get_unused_page_num(Pager* pager);
+void free_page(Pager* pager, uint32_t page_num);
+void free_tree_pages(Pager* pager, uint32_t page_num);
 void create_new_root(Table* table, uint32_t right_child_page_num);
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_right_child (void* node);
@@ -187,61 +449,162 @@ uint32_t* node_parent(void* node);
 void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
 uint32_t internal_node_find_child(void* node, uint32_t key);
 void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-
+void initialize_file_header(void* header, uint32_t page_size);
+uint32_t* file_header_version(void* header);
+uint32_t* file_header_page_count(void* header);
+uint32_t* file_header_page_size(void* header);
+uint32_t* file_header_backup_generation(void* header);
+uint8_t* file_header_changed_pages(void* header);
+uint32_t* file_header_free_page_head(void* header);
+uint64_t* file_header_database_id(void* header);
+uint64_t new_database_id();
+uint32_t* catalog_num_tables(void* header);
+void* catalog_entry(void* header, uint32_t entry_num);
+char* catalog_entry_name(void* entry);
+uint32_t* catalog_entry_root_page(void* entry);
+uint32_t* catalog_entry_schema(void* entry);
+void catalog_add_table(void* header, const char* name, uint32_t root_page_num);
+void pager_mark_changed(Pager* pager, uint32_t page_num);
+void pager_mark_dirty(Pager* pager, uint32_t page_num);
+void pager_write_header(Pager* pager);
+uint32_t pager_pages_available(Pager* pager);
+bool leaf_insert_fits(Cursor* cursor);
+void db_sync(Database* database);
+bool pager_page_changed(Pager* pager, uint32_t page_num);
+void backup_database(Database* database, const char* path, bool incremental, FILE* out);
+bool backup_copy_page(Pager* pager, int fd, uint32_t page_num, void* buffer, uint32_t generation);
+bool is_same_file(struct stat* file_stat, const char* path);
+void execute_input(InputBuffer* buffer, Database* database, FILE* out);
+void run_server(Database* database, const char* socket_path);
+void* server_worker(void* arg);
+bool server_handle_request(Server* server, int fd);
+bool read_fully(int fd, void* buffer, size_t length);
+bool write_fully(int fd, const void* buffer, size_t length);
+uint64_t now_us();
+void record_latency(LatencyHistogram* histogram, uint64_t latency_us);
+uint64_t latency_percentile(LatencyHistogram* histogram, double percentile);
+void collect_tree_stats(Pager* pager, uint32_t page_num, uint32_t depth, TreeStats* tree_stats);
+void print_stats(Table* table, FILE* out);
+void print_stats_json(Table* table, FILE* out);
+void print_latency_json(LatencyHistogram* histogram, FILE* out);
+
+// Embedders such as bench/bench.c include this file with DB_NO_MAIN defined.
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
     if(argc < 2) {
         printf("Must supply a database filename\n");
         exit(1);
     }
 
-    Table* table = db_open(argv[1]);
+    const char* socket_path = NULL;
+    uint32_t page_size = DEFAULT_PAGE_SIZE; // Only used when creating a new db file
+    uint32_t pager_flags = 0;
+    for(int i = 2; i < argc; ++i) {
+        if(strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if(strcmp(argv[i], "--direct-io") == 0) {
+            pager_flags |= PAGER_DIRECT_IO;
+        } else if(strcmp(argv[i], "--huge-pages") == 0) {
+            pager_flags |= PAGER_HUGE_PAGES;
+        } else if(strcmp(argv[i], "--sort-memory-rows") == 0 && i + 1 < argc) {
+            int rows = atoi(argv[++i]);
+            sort_memory_rows = rows;
+            if(rows < 1) {
+                printf("Sort memory rows must be at least 1\n");
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "--sort-fan-in") == 0 && i + 1 < argc) {
+            int fan_in = atoi(argv[++i]);
+            sort_merge_fan_in = fan_in;
+            if(fan_in < 2) {
+                printf("Sort fan-in must be at least 2\n");
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            page_size = atoi(argv[++i]);
+            if(!is_valid_page_size(page_size)) {
+                printf("Page size must be a power of two from %d to %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(1);
+            }
+        } else {
+            printf("Unrecognized option [%s]\n", argv[i]);
+            printf("Usage: %s <filename> [--page-size <bytes>] [--direct-io] [--huge-pages] "
+                   "[--sort-memory-rows <rows>] [--sort-fan-in <runs>] [--server <socket path>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    Database* database = db_open(argv[1], page_size, pager_flags);
+
+    if(socket_path) {
+        run_server(database, socket_path);
+        db_close(database);
+        return 0;
+    }
+
     InputBuffer* input_buffer = new_input_buffer();
 
     while(true) {
         print_prompt();
         read_input(input_buffer);
-
-        if(input_buffer->buffer[0] == '.') { // Meta command
-            switch(do_meta_command(input_buffer, table)) {
-            case (META_COMMAND_SUCCESS):
-                continue;
-            case META_COMMAND_UNRECOGNIZED:
-                printf("Unrecognized command [%s]\n", input_buffer->buffer);
-                continue;
-            }
+        execute_input(input_buffer, database, stdout);
+    }
+}
+#endif
+
+void execute_input(InputBuffer* buffer, Database* database, FILE* out) {
+    if(buffer->buffer[0] == '.') { // Meta command
+        switch(do_meta_command(buffer, database, out)) {
+        case (META_COMMAND_SUCCESS):
+            return;
+        case META_COMMAND_UNRECOGNIZED:
+            fprintf(out, "Unrecognized command [%s]\n", buffer->buffer);
+            return;
         }
+    }
 
-        // Not a meta command
-        Statement statement;
-        switch(prepare_statement(input_buffer, &statement)) {
-        case PREPARE_SUCCESS:
-            break;
-        case PREPARE_SYNTAX_ERROR:
-            printf("Syntax error. Could not parse statement\n");
-            continue;
-        case PREPARE_UNRECOGNIZED:
-            printf("Unrecognized keyword at start of [%s]\n", input_buffer->buffer);
-            continue;
-        case PREPARE_STRING_TOO_LONG:
-            printf("String is too long\n");
-            continue;
-        case PREPARE_INVALID_ID:
-            printf("Id must be positive\n");
-            continue;
-        }
+    // Not a meta command
+    Statement statement;
+    switch(prepare_statement(buffer, &statement)) {
+    case PREPARE_SUCCESS:
+        break;
+    case PREPARE_SYNTAX_ERROR:
+        fprintf(out, "Syntax error. Could not parse statement\n");
+        return;
+    case PREPARE_UNRECOGNIZED:
+        fprintf(out, "Unrecognized keyword at start of [%s]\n", buffer->buffer);
+        return;
+    case PREPARE_STRING_TOO_LONG:
+        fprintf(out, "String is too long\n");
+        return;
+    case PREPARE_INVALID_ID:
+        fprintf(out, "Id must be positive\n");
+        return;
+    }
 
-        // We have a real Statement here
-        switch(execute_statement(&statement, table)) {
-        case EXECUTE_SUCCESS:
-            printf("Executed\n");
-            break;
-        case EXECUTE_TABLE_FULL:
-            printf("Error: Table full\n");
-            break;
-        case EXECUTE_DUPLICATE_KEY:
-            printf("Error: Duplicate key\n");
-            break;
-        }
+    // We have a real Statement here
+    switch(execute_statement(&statement, database, out)) {
+    case EXECUTE_SUCCESS:
+        fprintf(out, "Executed\n");
+        break;
+    case EXECUTE_TABLE_FULL:
+        fprintf(out, "Error: Table full\n");
+        break;
+    case EXECUTE_DUPLICATE_KEY:
+        fprintf(out, "Error: Duplicate key\n");
+        break;
+    case EXECUTE_NO_SUCH_TABLE:
+        fprintf(out, "Error: No such table %s\n", statement.table_name);
+        break;
+    case EXECUTE_TABLE_EXISTS:
+        fprintf(out, "Error: Table %s already exists\n", statement.table_name);
+        break;
+    case EXECUTE_CATALOG_FULL:
+        fprintf(out, "Error: Catalog full\n");
+        break;
+    case EXECUTE_DATABASE_FULL:
+        fprintf(out, "Error: Database full\n");
+        break;
     }
 }
 
@@ -254,6 +617,7 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child
 
     uint32_t original_num_keys = *internal_node_num_keys(parent);
     *internal_node_num_keys(parent) = original_num_keys + 1;
+    pager_mark_changed(table->pager, parent_page_num);
 
     if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
         printf("Need to implement splitting internal node\n");
@@ -330,39 +694,39 @@ Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
     }
 }
 
-void indent(uint32_t level) {
+void indent(uint32_t level, FILE* out) {
     for (uint32_t i = 0; i < level; ++i) {
-        printf(" ");
+        fprintf(out, " ");
     }
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level, FILE* out) {
     void* node = get_page(pager, page_num);
     uint32_t num_keys, child;
 
     switch (get_node_type(node)) {
     case NODE_LEAF:
         num_keys = *leaf_node_num_cells(node);
-        indent(indentation_level);
-        printf("- leaf (size %d)\n", num_keys);
+        indent(indentation_level, out);
+        fprintf(out, "- leaf (size %d)\n", num_keys);
         for (uint32_t i = 0; i < num_keys; ++i) {
-            indent(indentation_level + 1);
-            printf("- %d\n", *leaf_node_key(node, i));
+            indent(indentation_level + 1, out);
+            fprintf(out, "- %d\n", *leaf_node_key(node, i));
         }
         break;
     case NODE_INTERNAL:
         num_keys = *internal_node_num_keys(node);
-        indent(indentation_level);
-        printf("- internal (size %d)\n", num_keys);
+        indent(indentation_level, out);
+        fprintf(out, "- internal (size %d)\n", num_keys);
         for (uint32_t i = 0; i < num_keys; ++i) {
             child = *internal_node_child(node, i);
-            print_tree(pager, child, indentation_level + 1);
+            print_tree(pager, child, indentation_level + 1, out);
 
-            indent(indentation_level);
-            printf("- key %d\n", *internal_node_key(node, i));
+            indent(indentation_level, out);
+            fprintf(out, "- key %d\n", *internal_node_key(node, i));
         }
         child = *internal_node_right_child(node);
-        print_tree(pager, child, indentation_level + 1);
+        print_tree(pager, child, indentation_level + 1, out);
         break;
     }
 }
@@ -392,9 +756,43 @@ uint32_t get_node_max_key(void* node) {
     }
 }
 
-// Not recycling free pages yet.
+/*
+    Reuse a page from the free list if there is one, otherwise append a new
+    page. The caller initializes the page and marks it changed.
+*/
 uint32_t get_unused_page_num(Pager* pager) {
-    return pager->num_pages;
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t page_num = *file_header_free_page_head(header);
+    if(page_num == 0) {
+        return pager->num_pages;
+    }
+
+    void* page = get_page(pager, page_num);
+    *file_header_free_page_head(header) = *(uint32_t*)(page + FREE_PAGE_NEXT_OFFSET);
+    pager_mark_changed(pager, HEADER_PAGE_NUM);
+    return page_num;
+}
+
+void free_page(Pager* pager, uint32_t page_num) {
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    void* page = get_page(pager, page_num);
+    memset(page, 0, pager->page_size);
+    *(uint32_t*)(page + FREE_PAGE_NEXT_OFFSET) = *file_header_free_page_head(header);
+    *file_header_free_page_head(header) = page_num;
+    pager_mark_changed(pager, page_num);
+    pager_mark_changed(pager, HEADER_PAGE_NUM);
+}
+
+// Put every page of the tree rooted at page_num on the free list.
+void free_tree_pages(Pager* pager, uint32_t page_num) {
+    void* node = get_page(pager, page_num);
+    if(get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for(uint32_t i = 0; i <= num_keys; ++i) {
+            free_tree_pages(pager, *internal_node_child(node, i));
+        }
+    }
+    free_page(pager, page_num);
 }
 
 uint32_t* internal_node_num_keys(void* node) {
@@ -434,12 +832,17 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
     New root node point to two children.
     */
 
+    table->stats.root_splits++;
+
     void* root = get_page(table->pager, table->root_page_num);
     void* right_child = get_page(table->pager, right_child_page_num);
     uint32_t left_child_page_num = get_unused_page_num(table->pager);
     void* left_child = get_page(table->pager, left_child_page_num);
+    pager_mark_changed(table->pager, table->root_page_num);
+    pager_mark_changed(table->pager, right_child_page_num);
+    pager_mark_changed(table->pager, left_child_page_num);
 
-    memcpy(left_child, root, PAGE_SIZE);
+    memcpy(left_child, root, table->pager->page_size);
     set_node_root(left_child, false);
 
     /* Root node is a new internal node with one key and two children */
@@ -461,10 +864,16 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     Update parent or create new parent.
     */
 
+    cursor->table->stats.leaf_splits++;
+
     void* old_node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t page_size = cursor->table->pager->page_size;
+    uint32_t left_split_count = leaf_node_left_split_count(page_size);
     uint32_t old_max = get_node_max_key(old_node);
     uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
     void* new_node = get_page(cursor->table->pager, new_page_num);
+    pager_mark_changed(cursor->table->pager, cursor->page_num);
+    pager_mark_changed(cursor->table->pager, new_page_num);
     initialize_leaf_node(new_node);
     *node_parent(new_node) = *node_parent(old_node);
     *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
@@ -475,9 +884,9 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     old (left) and new (right) nodes.
     Starting from the right, move each key to correct position.
     */
-    for(int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void* destination_node = (i >= LEAF_NODE_LEFT_SPLIT_COUNT) ? new_node : old_node;
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
+    for(int32_t i = leaf_node_max_cells(page_size); i >= 0; i--) {
+        void* destination_node = (i >= left_split_count) ? new_node : old_node;
+        uint32_t index_within_node = i % left_split_count;
         void* destination = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num) {
@@ -492,8 +901,8 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 
 
     /* Update cell count on both leaf nodes */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    *(leaf_node_num_cells(old_node)) = left_split_count;
+    *(leaf_node_num_cells(new_node)) = leaf_node_right_split_count(page_size);
 
     if (is_node_root(old_node)) {
         return create_new_root(cursor->table, new_page_num);
@@ -502,6 +911,7 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
         uint32_t new_max = get_node_max_key(old_node);
         void* parent = get_page(cursor->table->pager, parent_page_num);
 
+        pager_mark_changed(cursor->table->pager, parent_page_num);
         update_internal_node_key(parent, old_max, new_max);
         internal_node_insert(cursor->table, parent_page_num, new_page_num);
         return;
@@ -588,12 +998,14 @@ void initialize_leaf_node(void* node) {
     void* node = get_page(cursor->table->pager, cursor->page_num);
 
     uint32_t num_cells = *leaf_node_num_cells(node);
-    if(num_cells >= LEAF_NODE_MAX_CELLS) {
+    if(num_cells >= leaf_node_max_cells(cursor->table->pager->page_size)) {
         // Node full
         leaf_node_split_and_insert(cursor, key, value);
         return;
     }
 
+    pager_mark_changed(cursor->table->pager, cursor->page_num);
+
     if(cursor->cell_num < num_cells) {
         // Make room for a new cell
         for(uint32_t i = num_cells; i > cursor->cell_num; i--) {
@@ -606,30 +1018,254 @@ void initialize_leaf_node(void* node) {
     serialize_row(value, leaf_node_value(node, cursor->cell_num));
  }
 
-MetaCommandResult do_meta_command(InputBuffer* buffer, Table* table) {
+/*
+    .stats and .btree report on the table named after them, or the default table.
+*/
+MetaCommandResult do_meta_command(InputBuffer* buffer, Database* database, FILE* out) {
+    const char* table_name = DEFAULT_TABLE_NAME;
+
     if(strcmp(buffer->buffer, ".exit") == 0) {
-        db_close(table);
+        db_close(database);
         exit(0);
     } else if(strcmp(buffer->buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        print_constants();
+        fprintf(out, "Constants:\n");
+        print_constants(database->pager, out);
         return META_COMMAND_SUCCESS;
-    } else if(strcmp(buffer->buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+    } else if(strcmp(buffer->buffer, ".tables") == 0) {
+        print_tables(database, out);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(buffer->buffer, ".stats json") == 0 || strncmp(buffer->buffer, ".stats json ", 12) == 0) {
+        if(buffer->buffer[11]) {
+            table_name = buffer->buffer + 12;
+        }
+        Table* table = database_find_table(database, table_name);
+        if(table) {
+            print_stats_json(table, out);
+        } else {
+            fprintf(out, "Error: No such table %s\n", table_name);
+        }
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(buffer->buffer, ".stats") == 0 || strncmp(buffer->buffer, ".stats ", 7) == 0) {
+        if(buffer->buffer[6]) {
+            table_name = buffer->buffer + 7;
+        }
+        Table* table = database_find_table(database, table_name);
+        if(table) {
+            print_stats(table, out);
+        } else {
+            fprintf(out, "Error: No such table %s\n", table_name);
+        }
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(buffer->buffer, ".backup incremental ", 20) == 0) {
+        backup_database(database, buffer->buffer + 20, true, out);
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(buffer->buffer, ".backup ", 8) == 0) {
+        backup_database(database, buffer->buffer + 8, false, out);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(buffer->buffer, ".btree") == 0 || strncmp(buffer->buffer, ".btree ", 7) == 0) {
+        if(buffer->buffer[6]) {
+            table_name = buffer->buffer + 7;
+        }
+        Table* table = database_find_table(database, table_name);
+        if(table) {
+            fprintf(out, "Tree:\n");
+            print_tree(table->pager, table->root_page_num, 0, out);
+        } else {
+            fprintf(out, "Error: No such table %s\n", table_name);
+        }
         return META_COMMAND_SUCCESS;
     } else {
         return META_COMMAND_UNRECOGNIZED;
     }
 }
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void print_tables(Database* database, FILE* out) {
+    void* header = get_page(database->pager, HEADER_PAGE_NUM);
+    for(uint32_t i = 0; i < database->num_tables; ++i) {
+        void* entry = catalog_entry(header, i);
+        fprintf(out, "%s (id, username, email) root page %d\n",
+                catalog_entry_name(entry), *catalog_entry_root_page(entry));
+    }
+}
+
+void print_constants(Pager* pager, FILE* out) {
+    fprintf(out, "ROW_SIZE: %d\n", ROW_SIZE);
+    fprintf(out, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    fprintf(out, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    fprintf(out, "LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    fprintf(out, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", leaf_node_space_for_cells(pager->page_size));
+    fprintf(out, "LEAF_NODE_MAX_CELLS: %d\n", leaf_node_max_cells(pager->page_size));
+}
+
+bool is_valid_page_size(uint32_t page_size) {
+    bool power_of_two = page_size && (page_size & (page_size - 1)) == 0;
+    return power_of_two && page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE;
+}
+
+uint32_t leaf_node_space_for_cells(uint32_t page_size) {
+    return page_size - LEAF_NODE_HEADER_SIZE;
+}
+
+uint32_t leaf_node_max_cells(uint32_t page_size) {
+    return leaf_node_space_for_cells(page_size) / LEAF_NODE_CELL_SIZE;
+}
+
+uint32_t leaf_node_right_split_count(uint32_t page_size) {
+    return (leaf_node_max_cells(page_size) + 1) / 2;
+}
+
+uint32_t leaf_node_left_split_count(uint32_t page_size) {
+    return (leaf_node_max_cells(page_size) + 1) - leaf_node_right_split_count(page_size);
+}
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void record_latency(LatencyHistogram* histogram, uint64_t latency_us) {
+    uint32_t bucket = 0;
+    while(bucket < LATENCY_HISTOGRAM_BUCKETS - 1 && latency_us >= ((uint64_t)1 << bucket)) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += latency_us;
+}
+
+/*
+    Return the upper bound of the bucket holding the given percentile (0-100).
+*/
+uint64_t latency_percentile(LatencyHistogram* histogram, double percentile) {
+    if(histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0);
+    if(rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if(seen > rank) {
+            return (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+void collect_tree_stats(Pager* pager, uint32_t page_num, uint32_t depth, TreeStats* tree_stats) {
+    void* node = get_page(pager, page_num);
+
+    if(depth > tree_stats->depth) {
+        tree_stats->depth = depth;
+    }
+
+    switch (get_node_type(node)) {
+    case NODE_LEAF:
+        tree_stats->num_leaves++;
+        tree_stats->num_cells += *leaf_node_num_cells(node);
+        break;
+    case NODE_INTERNAL:
+        tree_stats->num_internal_nodes++;
+        for (uint32_t i = 0; i <= *internal_node_num_keys(node); ++i) {
+            collect_tree_stats(pager, *internal_node_child(node, i), depth + 1, tree_stats);
+        }
+        break;
+    }
+}
+
+void print_stats(Table* table, FILE* out) {
+    PagerStats pager_stats = table->pager->stats; // Copied so the tree walk below isn't counted
+    TableStats* table_stats = &table->stats;
+    TreeStats tree_stats = {0};
+    collect_tree_stats(table->pager, table->root_page_num, 1, &tree_stats);
+
+    fprintf(out, "Pager:\n");
+    fprintf(out, "  page size: %d\n", table->pager->page_size);
+    fprintf(out, "  frame arena bytes: %zu\n", table->pager->frames_size);
+    fprintf(out, "  direct io: %s\n", (table->pager->flags & PAGER_DIRECT_IO) ? "on" : "off");
+    fprintf(out, "  page hits: %llu\n", (unsigned long long)pager_stats.page_hits);
+    fprintf(out, "  page misses: %llu\n", (unsigned long long)pager_stats.page_misses);
+    fprintf(out, "  bytes read: %llu\n", (unsigned long long)pager_stats.bytes_read);
+    fprintf(out, "  bytes written: %llu\n", (unsigned long long)pager_stats.bytes_written);
+    fprintf(out, "  flushes: %llu\n", (unsigned long long)pager_stats.flushes);
+
+    fprintf(out, "B-tree:\n");
+    fprintf(out, "  depth: %d\n", tree_stats.depth);
+    fprintf(out, "  leaf nodes: %d\n", tree_stats.num_leaves);
+    fprintf(out, "  internal nodes: %d\n", tree_stats.num_internal_nodes);
+    fprintf(out, "  average leaf fill: %.1f%%\n",
+            100.0 * tree_stats.num_cells / (tree_stats.num_leaves * leaf_node_max_cells(table->pager->page_size)));
+    fprintf(out, "  leaf splits: %llu\n", (unsigned long long)table_stats->leaf_splits);
+    fprintf(out, "  root splits: %llu\n", (unsigned long long)table_stats->root_splits);
+
+    LatencyHistogram* histograms[] = { &table_stats->insert_latency, &table_stats->select_latency };
+    const char* names[] = { "insert", "select" };
+    fprintf(out, "Latency (us):\n");
+    for(uint32_t h = 0; h < 2; ++h) {
+        LatencyHistogram* histogram = histograms[h];
+        fprintf(out, "  %s: count %llu, p50 < %llu, p99 < %llu\n", names[h],
+                (unsigned long long)histogram->count,
+                (unsigned long long)latency_percentile(histogram, 50),
+                (unsigned long long)latency_percentile(histogram, 99));
+        for(uint32_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+            if(histogram->buckets[i]) {
+                fprintf(out, "    < %llu: %llu\n", (unsigned long long)1 << i,
+                        (unsigned long long)histogram->buckets[i]);
+            }
+        }
+    }
+
+    fprintf(out, "Sort:\n");
+    fprintf(out, "  runs spilled: %llu\n", (unsigned long long)table_stats->sort_runs_spilled);
+}
+
+void print_latency_json(LatencyHistogram* histogram, FILE* out) {
+    fprintf(out, "{\"count\": %llu, \"total_us\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, \"buckets\": [",
+            (unsigned long long)histogram->count,
+            (unsigned long long)histogram->total_us,
+            (unsigned long long)latency_percentile(histogram, 50),
+            (unsigned long long)latency_percentile(histogram, 99));
+    for(uint32_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)histogram->buckets[i]);
+    }
+    fprintf(out, "]}");
+}
+
+/*
+    Single-line JSON dump of the same counters as print_stats, for scripts.
+*/
+void print_stats_json(Table* table, FILE* out) {
+    PagerStats pager_stats = table->pager->stats; // Copied so the tree walk below isn't counted
+    TableStats* table_stats = &table->stats;
+    TreeStats tree_stats = {0};
+    collect_tree_stats(table->pager, table->root_page_num, 1, &tree_stats);
+
+    fprintf(out, "{\"pager\": {\"page_size\": %d, \"frame_arena_bytes\": %zu, \"direct_io\": %s, "
+                 "\"page_hits\": %llu, \"page_misses\": %llu, \"bytes_read\": %llu, "
+                 "\"bytes_written\": %llu, \"flushes\": %llu}, ",
+            table->pager->page_size, table->pager->frames_size,
+            (table->pager->flags & PAGER_DIRECT_IO) ? "true" : "false",
+            (unsigned long long)pager_stats.page_hits,
+            (unsigned long long)pager_stats.page_misses,
+            (unsigned long long)pager_stats.bytes_read,
+            (unsigned long long)pager_stats.bytes_written,
+            (unsigned long long)pager_stats.flushes);
+    fprintf(out, "\"btree\": {\"depth\": %d, \"leaf_nodes\": %d, \"internal_nodes\": %d, "
+                 "\"cells\": %llu, \"max_cells_per_leaf\": %d, \"leaf_splits\": %llu, \"root_splits\": %llu}, ",
+            tree_stats.depth, tree_stats.num_leaves, tree_stats.num_internal_nodes,
+            (unsigned long long)tree_stats.num_cells, leaf_node_max_cells(table->pager->page_size),
+            (unsigned long long)table_stats->leaf_splits,
+            (unsigned long long)table_stats->root_splits);
+    fprintf(out, "\"latency\": {\"insert\": ");
+    print_latency_json(&table_stats->insert_latency, out);
+    fprintf(out, ", \"select\": ");
+    print_latency_json(&table_stats->select_latency, out);
+    fprintf(out, "}, \"sort\": {\"runs_spilled\": %llu}}\n", (unsigned long long)table_stats->sort_runs_spilled);
 }
 
 Cursor* table_start(Table* table) {
@@ -641,11 +1277,22 @@ Cursor* table_start(Table* table) {
     return cursor;
 }
 
+/*
+    insert [into <table>] <id> <username> <email>
+*/
 PrepareResult prepare_insert(InputBuffer* buffer, Statement* statement) {
     statement->type = STATEMENT_INSERT;
+    strcpy(statement->table_name, DEFAULT_TABLE_NAME);
 
     char* keyword = strtok(buffer->buffer, " ");
     char* id_str = strtok(NULL, " ");
+    if(id_str && strcmp(id_str, "into") == 0) {
+        PrepareResult result = prepare_table_name(strtok(NULL, " "), statement);
+        if(result != PREPARE_SUCCESS) {
+            return result;
+        }
+        id_str = strtok(NULL, " ");
+    }
     char* username = strtok(NULL, " ");
     char* email = strtok(NULL, " ");
 
@@ -667,146 +1314,1305 @@ PrepareResult prepare_insert(InputBuffer* buffer, Statement* statement) {
     return PREPARE_SUCCESS;
 }
 
-Pager* pager_open(const char* filename) {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+/*
+    select [*|column[,column...]] [from <table>]
+           [where id = N | where username|email =|like|contains value]
+           [order by username|email [asc|desc]] [limit N]
+*/
+PrepareResult prepare_select(InputBuffer* buffer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    strcpy(statement->table_name, DEFAULT_TABLE_NAME);
+    statement->columns = 0;
+    statement->predicate.op = PREDICATE_NONE;
+    statement->select_by_id = false;
+    statement->order_by = ORDER_NONE;
+    statement->order_descending = false;
+    statement->has_limit = false;
+
+    strtok(buffer->buffer, " "); // Skip "select"
+    char* token = strtok(NULL, " ");
+
+    // Column list: any tokens before the first clause keyword
+    while(token && strcmp(token, "from") != 0 && strcmp(token, "where") != 0 &&
+          strcmp(token, "order") != 0 && strcmp(token, "limit") != 0) {
+        char* name = token;
+        while(*name) {
+            char* comma = strchr(name, ',');
+            if(comma) {
+                *comma = '\0';
+            }
+            if(strcmp(name, "*") == 0) {
+                statement->columns |= COLUMN_ALL;
+            } else if(strcmp(name, "id") == 0) {
+                statement->columns |= COLUMN_ID;
+            } else if(strcmp(name, "username") == 0) {
+                statement->columns |= COLUMN_USERNAME;
+            } else if(strcmp(name, "email") == 0) {
+                statement->columns |= COLUMN_EMAIL;
+            } else if(*name) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            if(!comma) {
+                break;
+            }
+            name = comma + 1;
+        }
+        token = strtok(NULL, " ");
+    }
+    if(statement->columns == 0) {
+        statement->columns = COLUMN_ALL;
+    }
 
-    if(fd == -1) {
-        printf("Unable to open file\n");
-        exit(1);
+    if(token && strcmp(token, "from") == 0) {
+        PrepareResult result = prepare_table_name(strtok(NULL, " "), statement);
+        if(result != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = strtok(NULL, " ");
     }
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+    if(token && strcmp(token, "where") == 0) {
+        char* column = strtok(NULL, " ");
+        char* op = strtok(NULL, " ");
+        char* value = strtok(NULL, " ");
 
-    Pager* pager = (Pager*) malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = file_length / PAGE_SIZE;
+        if(!column || !op || !value) {
+            return PREPARE_SYNTAX_ERROR;
+        }
 
-    if(file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file\n");
-        exit(1);
-    }
+        if(strcmp(column, "id") == 0) {
+            if(strcmp(op, "=") != 0) {
+                return PREPARE_SYNTAX_ERROR;
+            }
 
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; ++i) {
-        pager->pages[i] = NULL;
-    }
+            int id = atoi(value);
+            if(id < 0)
+                return PREPARE_INVALID_ID;
 
-    return pager;
-}
+            statement->select_by_id = true;
+            statement->select_id = id;
+        } else {
+            PrepareResult result = prepare_predicate(column, op, value, &statement->predicate);
+            if(result != PREPARE_SUCCESS) {
+                return result;
+            }
+        }
+        token = strtok(NULL, " ");
+    }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
+    if(token && strcmp(token, "order") == 0) {
+        char* by = strtok(NULL, " ");
+        char* column = strtok(NULL, " ");
 
-    for(uint32_t i = 0; i < pager->num_pages; ++i) {
-        if(pager->pages[i] == NULL) {
-            continue;
+        if(!by || strcmp(by, "by") != 0 || !column) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if(strcmp(column, "username") == 0) {
+            statement->order_by = ORDER_BY_USERNAME;
+        } else if(strcmp(column, "email") == 0) {
+            statement->order_by = ORDER_BY_EMAIL;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
         }
 
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        token = strtok(NULL, " ");
+        if(token && (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0)) {
+            statement->order_descending = (strcmp(token, "desc") == 0);
+            token = strtok(NULL, " ");
+        }
     }
 
-    int result = close(pager->file_descriptor);
-    if(result == -1) {
-        printf("Error closing db file\n");
-        exit(1);
+    if(token && strcmp(token, "limit") == 0) {
+        char* limit_str = strtok(NULL, " ");
+        char* end = NULL;
+        long limit = limit_str ? strtol(limit_str, &end, 10) : -1;
+        if(!limit_str || *end != '\0' || end == limit_str || limit < 0 || limit > UINT32_MAX) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->has_limit = true;
+        statement->limit = limit;
+        token = strtok(NULL, " ");
     }
 
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; ++i) {
-        void* page = pager->pages[i];
-        if(page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+    if(token) {
+        return PREPARE_SYNTAX_ERROR;
     }
 
-    free(pager);
+    return PREPARE_SUCCESS;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if(pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(1);
-    }
-
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+/*
+    create table <name>
+    drop table <name>
+*/
+PrepareResult prepare_table_statement(InputBuffer* buffer, Statement* statement) {
+    char* keyword = strtok(buffer->buffer, " ");
+    char* table_keyword = strtok(NULL, " ");
+    char* name = strtok(NULL, " ");
 
-    if(offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(1);
+    statement->type = strcmp(keyword, "create") == 0 ? STATEMENT_CREATE_TABLE : STATEMENT_DROP_TABLE;
+    if(!table_keyword || strcmp(table_keyword, "table") != 0 || strtok(NULL, " ")) {
+        return PREPARE_SYNTAX_ERROR;
     }
+    return prepare_table_name(name, statement);
+}
 
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-    if(bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(1);
+// Table names are 1 to TABLE_NAME_MAX_LENGTH letters, digits, or underscores.
+// "json" is reserved because ".stats json" selects the output format.
+PrepareResult prepare_table_name(char* name, Statement* statement) {
+    if(!name || !*name || strcmp(name, "json") == 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    for(char* c = name; *c; ++c) {
+        bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_';
+        if(!valid) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    if(strlen(name) > TABLE_NAME_MAX_LENGTH) {
+        return PREPARE_STRING_TOO_LONG;
     }
+
+    strcpy(statement->table_name, name);
+    return PREPARE_SUCCESS;
 }
 
-PrepareResult prepare_statement(InputBuffer* buffer, Statement* statement) {
-    if(strncmp(buffer->buffer, "insert", 6) == 0) { // Starts with 'insert'...followed by more
-       return prepare_insert(buffer, statement);
+/*
+    Build a predicate on username or email. "like" takes a 'prefix%' pattern;
+    without the trailing % it is plain equality.
+*/
+PrepareResult prepare_predicate(char* column, char* op, char* value, Predicate* predicate) {
+    if(strcmp(column, "username") == 0) {
+        predicate->column_offset = USERNAME_OFFSET;
+        predicate->column_size = USERNAME_SIZE;
+    } else if(strcmp(column, "email") == 0) {
+        predicate->column_offset = EMAIL_OFFSET;
+        predicate->column_size = EMAIL_SIZE;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
     }
 
-    if(strcmp(buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+    size_t len = strlen(value);
+    if(len >= 2 && value[0] == '\'' && value[len - 1] == '\'') {
+        value++;
+        len -= 2;
     }
 
-    return PREPARE_UNRECOGNIZED;
-}
+    if(strcmp(op, "=") == 0) {
+        predicate->op = PREDICATE_EQUALS;
+    } else if(strcmp(op, "like") == 0) {
+        predicate->op = PREDICATE_EQUALS;
+        if(len > 0 && value[len - 1] == '%') {
+            predicate->op = PREDICATE_PREFIX;
+            len--;
+        }
+        if(memchr(value, '%', len)) {
+            // Only a single trailing wildcard is supported
+            return PREPARE_SYNTAX_ERROR;
+        }
+    } else if(strcmp(op, "contains") == 0) {
+        predicate->op = PREDICATE_CONTAINS;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
 
-// This is our VM
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-    switch(statement->type) {
-    case STATEMENT_INSERT:
-        return execute_insert(statement, table);
-    case STATEMENT_SELECT:
-        return execute_select(statement, table);
+    if(len > predicate->column_size - 1) {
+        return PREPARE_STRING_TOO_LONG;
     }
-}
+
+    memset(predicate->needle, 0, sizeof(predicate->needle));
+    memcpy(predicate->needle, value, len);
+    predicate->needle_len = len;
+    predicate->match_len = (predicate->op == PREDICATE_EQUALS) ? len + 1 : len;
+    return PREPARE_SUCCESS;
+}
+
+/*
+    Open the db file. page_size is only used if the file is new; an existing
+    file's page size comes from its header.
+*/
+Pager* pager_open(const char* filename, uint32_t page_size, uint32_t flags) {
+    int fd = open_db_file(filename, flags);
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    if(file_length == -1) {
+        printf("Error seeking: %d\n", errno);
+        exit(1);
+    }
+
+    if(is_legacy_db_file(fd, file_length)) {
+        close(fd);
+        upgrade_legacy_db_file(filename, file_length);
+        fd = open_db_file(filename, flags);
+        file_length = lseek(fd, 0, SEEK_END);
+    }
+
+    uint32_t header_page_count = 0;
+    uint32_t version = FILE_FORMAT_VERSION;
+    uint32_t backup_generation = 0;
+    uint8_t* changed_pages = malloc(FILE_HEADER_CHANGED_PAGES_SIZE);
+    // New files and files written before change tracking count every page as changed
+    memset(changed_pages, 0xff, FILE_HEADER_CHANGED_PAGES_SIZE);
+
+    if(file_length > 0) {
+        // Read a whole aligned minimum-size page so this also works under O_DIRECT
+        void* header = NULL;
+        posix_memalign(&header, MIN_PAGE_SIZE, MIN_PAGE_SIZE);
+        ssize_t bytes_read = pread(fd, header, MIN_PAGE_SIZE, 0);
+        if(bytes_read < (ssize_t)FILE_HEADER_SIZE ||
+           memcmp(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE) != 0) {
+            printf("Db file has no valid header. Corrupt file\n");
+            exit(1);
+        }
+
+        version = *file_header_version(header);
+        if(version == 1) {
+            page_size = DEFAULT_PAGE_SIZE;
+        } else if(version >= 2 && version <= FILE_FORMAT_VERSION) {
+            page_size = *file_header_page_size(header);
+        } else {
+            printf("Unsupported db file format version %d\n", version);
+            exit(1);
+        }
+        if(!is_valid_page_size(page_size)) {
+            printf("Db file has invalid page size %d. Corrupt file\n", page_size);
+            exit(1);
+        }
+
+        header_page_count = *file_header_page_count(header);
+        if(version >= 3) {
+            backup_generation = *file_header_backup_generation(header);
+            memcpy(changed_pages, file_header_changed_pages(header), FILE_HEADER_CHANGED_PAGES_SIZE);
+        }
+        free(header);
+    }
+
+    Pager* pager = (Pager*) malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->page_size = page_size;
+    pager->num_pages = file_length / page_size;
+    pager->flags = flags;
+    pager->frames = allocate_frames(page_size, flags, &pager->frames_size);
+    pager->changed_pages = changed_pages;
+    pager->dirty_pages = calloc(FILE_HEADER_CHANGED_PAGES_SIZE, 1);
+    pager->backup_generation = backup_generation;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+
+    if(file_length % page_size != 0) {
+        printf("Db file is not a whole number of pages. Corrupt file\n");
+        exit(1);
+    }
+
+    if(header_page_count != pager->num_pages) {
+        printf("Db file has %d pages but header records %d. Corrupt file\n",
+               pager->num_pages, header_page_count);
+        exit(1);
+    }
+
+    for(uint32_t i = 0; i < TABLE_MAX_PAGES; ++i) {
+        pager->pages[i] = NULL;
+    }
+
+    return pager;
+}
+
+int open_db_file(const char* filename, uint32_t flags) {
+    int open_flags = O_RDWR | O_CREAT;
+
+    if(flags & PAGER_DIRECT_IO) {
+#if defined(O_DIRECT)
+        open_flags |= O_DIRECT;
+#elif !defined(F_NOCACHE)
+        printf("Direct I/O is not supported on this platform\n");
+        exit(1);
+#endif
+    }
+
+    int fd = open(filename, open_flags, S_IWUSR | S_IRUSR);
+
+    if(fd == -1 && (flags & PAGER_DIRECT_IO) && errno == EINVAL) {
+        printf("File system does not support direct I/O\n");
+        exit(1);
+    }
+    if(fd == -1) {
+        printf("Unable to open file\n");
+        exit(1);
+    }
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if(flags & PAGER_DIRECT_IO) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+#endif
+
+    return fd;
+}
+
+/*
+    Files written before the header existed start with the root node on
+    page 0 and always use 4096-byte pages.
+*/
+bool is_legacy_db_file(int fd, off_t file_length) {
+    if(file_length == 0 || file_length % DEFAULT_PAGE_SIZE != 0) {
+        return false;
+    }
+
+    void* page = NULL;
+    posix_memalign(&page, MIN_PAGE_SIZE, MIN_PAGE_SIZE);
+    bool legacy = pread(fd, page, MIN_PAGE_SIZE, 0) == MIN_PAGE_SIZE &&
+        memcmp(page + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE) != 0 &&
+        (get_node_type(page) == NODE_LEAF || get_node_type(page) == NODE_INTERNAL) &&
+        is_node_root(page);
+    free(page);
+    return legacy;
+}
+
+/*
+    Rewrite a headerless file with a header and catalog on page 0 and every
+    node moved up one page. The copy is built in <filename>.upgrade and
+    renamed over the original, so a failed upgrade leaves the file as it was.
+*/
+void upgrade_legacy_db_file(const char* filename, off_t file_length) {
+    uint32_t num_pages = file_length / DEFAULT_PAGE_SIZE;
+    if(num_pages + 1 > TABLE_MAX_PAGES) {
+        printf("Db file was created before format versioning and is too large to upgrade\n");
+        exit(1);
+    }
+
+    char* upgrade_path = malloc(strlen(filename) + 9);
+    sprintf(upgrade_path, "%s.upgrade", filename);
+    int in = open(filename, O_RDONLY);
+    int out = open(upgrade_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(in == -1 || out == -1) {
+        printf("Unable to upgrade db file created before format versioning\n");
+        exit(1);
+    }
+
+    void* page = malloc(DEFAULT_PAGE_SIZE);
+    bool ok = true;
+    for(uint32_t i = 0; i < num_pages && ok; ++i) {
+        ok = pread(in, page, DEFAULT_PAGE_SIZE, (off_t)i * DEFAULT_PAGE_SIZE) == DEFAULT_PAGE_SIZE;
+        shift_legacy_page_numbers(page);
+        ok = ok && pwrite(out, page, DEFAULT_PAGE_SIZE, (off_t)(i + 1) * DEFAULT_PAGE_SIZE) == DEFAULT_PAGE_SIZE;
+    }
+
+    initialize_file_header(page, DEFAULT_PAGE_SIZE);
+    *file_header_page_count(page) = num_pages + 1;
+    memset(file_header_changed_pages(page), 0xff, FILE_HEADER_CHANGED_PAGES_SIZE);
+    catalog_add_table(page, DEFAULT_TABLE_NAME, DEFAULT_TABLE_ROOT_PAGE_NUM);
+    ok = ok && pwrite(out, page, DEFAULT_PAGE_SIZE, 0) == DEFAULT_PAGE_SIZE;
+    ok = ok && fsync(out) == 0;
+    ok = close(out) == 0 && ok;
+    close(in);
+    ok = ok && rename(upgrade_path, filename) == 0;
+    if(!ok) {
+        printf("Unable to upgrade db file created before format versioning: %d\n", errno);
+        unlink(upgrade_path);
+        exit(1);
+    }
+
+    free(page);
+    free(upgrade_path);
+}
+
+// Page n of a headerless file becomes page n + 1.
+void shift_legacy_page_numbers(void* node) {
+    if(!is_node_root(node)) {
+        *node_parent(node) += 1;
+    }
+    if(get_node_type(node) == NODE_LEAF) {
+        if(*leaf_node_next_leaf(node) != 0) {
+            *leaf_node_next_leaf(node) += 1;
+        }
+    } else {
+        for(uint32_t i = 0; i <= *internal_node_num_keys(node); ++i) {
+            *internal_node_child(node, i) += 1;
+        }
+    }
+}
+
+/*
+    One allocation for every frame the pager can hold, aligned for O_DIRECT
+    (or to a huge page boundary), so a cache miss never calls malloc.
+*/
+void* allocate_frames(uint32_t page_size, uint32_t flags, size_t* size) {
+    size_t alignment = page_size;
+    *size = (size_t)TABLE_MAX_PAGES * page_size;
+
+    if(flags & PAGER_HUGE_PAGES) {
+        alignment = HUGE_PAGE_SIZE;
+        *size = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    void* frames = NULL;
+    if(posix_memalign(&frames, alignment, *size) != 0) {
+        printf("Unable to allocate %zu bytes for page frames\n", *size);
+        exit(1);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if(flags & PAGER_HUGE_PAGES) {
+        madvise(frames, *size, MADV_HUGEPAGE); // Advisory; ignore failure
+    }
+#endif
+
+    return frames;
+}
+
+// Clears the whole page, so the catalog starts out empty.
+void initialize_file_header(void* header, uint32_t page_size) {
+    memset(header, 0, page_size);
+    memcpy(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE);
+    *file_header_version(header) = FILE_FORMAT_VERSION;
+    *file_header_page_count(header) = 0;
+    *file_header_page_size(header) = page_size;
+    *file_header_database_id(header) = new_database_id();
+}
+
+uint32_t* file_header_version(void* header) {
+    return header + FILE_HEADER_VERSION_OFFSET;
+}
+
+uint32_t* file_header_page_count(void* header) {
+    return header + FILE_HEADER_PAGE_COUNT_OFFSET;
+}
+
+uint32_t* file_header_page_size(void* header) {
+    return header + FILE_HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* file_header_backup_generation(void* header) {
+    return header + FILE_HEADER_BACKUP_GENERATION_OFFSET;
+}
+
+uint8_t* file_header_changed_pages(void* header) {
+    return header + FILE_HEADER_CHANGED_PAGES_OFFSET;
+}
+
+uint32_t* file_header_free_page_head(void* header) {
+    return header + FILE_HEADER_FREE_PAGE_HEAD_OFFSET;
+}
+
+uint64_t* file_header_database_id(void* header) {
+    return header + FILE_HEADER_DATABASE_ID_OFFSET;
+}
+
+/*
+    Tells backups of different databases apart. Falls back to the clock and
+    pid if /dev/urandom can't be read.
+*/
+uint64_t new_database_id() {
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd == -1 || read(fd, &id, sizeof(id)) != sizeof(id)) {
+        id = now_us() ^ ((uint64_t)getpid() << 32);
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    return id;
+}
+
+uint32_t* catalog_num_tables(void* header) {
+    return header + CATALOG_NUM_TABLES_OFFSET;
+}
+
+void* catalog_entry(void* header, uint32_t entry_num) {
+    return header + CATALOG_NUM_TABLES_OFFSET + CATALOG_HEADER_SIZE + entry_num * CATALOG_ENTRY_SIZE;
+}
+
+char* catalog_entry_name(void* entry) {
+    return entry + CATALOG_ENTRY_NAME_OFFSET;
+}
+
+uint32_t* catalog_entry_root_page(void* entry) {
+    return entry + CATALOG_ENTRY_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* catalog_entry_schema(void* entry) {
+    return entry + CATALOG_ENTRY_SCHEMA_OFFSET;
+}
+
+// The caller checks the catalog has room and marks the header page changed.
+void catalog_add_table(void* header, const char* name, uint32_t root_page_num) {
+    void* entry = catalog_entry(header, *catalog_num_tables(header));
+    memset(entry, 0, CATALOG_ENTRY_SIZE);
+    strcpy(catalog_entry_name(entry), name);
+    *catalog_entry_root_page(entry) = root_page_num;
+    *catalog_entry_schema(entry) = SCHEMA_USERS;
+    *catalog_num_tables(header) += 1;
+}
+
+/*
+    Callers mark a page after modifying it so .backup incremental can skip
+    pages that haven't changed since the last backup, and db_sync knows
+    which pages to write.
+*/
+void pager_mark_changed(Pager* pager, uint32_t page_num) {
+    pager->changed_pages[page_num / 8] |= 1 << (page_num % 8);
+    pager_mark_dirty(pager, page_num);
+}
+
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+    pager->dirty_pages[page_num / 8] |= 1 << (page_num % 8);
+}
+
+/*
+    Pages the pager can still hand out: the free list plus the frames not
+    yet used.
+*/
+uint32_t pager_pages_available(Pager* pager) {
+    uint32_t available = TABLE_MAX_PAGES - pager->num_pages;
+    uint32_t page_num = *file_header_free_page_head(get_page(pager, HEADER_PAGE_NUM));
+    while(page_num != 0) {
+        available++;
+        page_num = *(uint32_t*)(get_page(pager, page_num) + FREE_PAGE_NEXT_OFFSET);
+    }
+    return available;
+}
+
+// Copy the in-memory header fields into page 0.
+void pager_write_header(Pager* pager) {
+    // Version 1 files are upgraded in place; their page size is already 4096
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    *file_header_version(header) = FILE_FORMAT_VERSION;
+    *file_header_page_count(header) = pager->num_pages;
+    *file_header_page_size(header) = pager->page_size;
+    *file_header_backup_generation(header) = pager->backup_generation;
+    memcpy(file_header_changed_pages(header), pager->changed_pages, FILE_HEADER_CHANGED_PAGES_SIZE);
+}
+
+/*
+    Write every page modified since the last sync, keeping them cached.
+    Pages never written to the file go too. The header records the page
+    count, so it is written last, once the pages it describes are durable;
+    a crash part way through leaves the file as it was at the last sync.
+*/
+void db_sync(Database* database) {
+    Pager* pager = database->pager;
+    uint32_t pages_on_disk = pager->file_length / pager->page_size;
+
+    bool dirty = pager->num_pages > pages_on_disk;
+    for(uint32_t i = 0; i < FILE_HEADER_CHANGED_PAGES_SIZE && !dirty; ++i) {
+        dirty = pager->dirty_pages[i] != 0;
+    }
+    if(!dirty) {
+        return;
+    }
+
+    for(uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; ++i) {
+        bool page_dirty = pager->dirty_pages[i / 8] & (1 << (i % 8));
+        if(pager->pages[i] && (page_dirty || i >= pages_on_disk)) {
+            pager_flush(pager, i);
+        }
+    }
+    pager_fsync(pager);
+    pager_write_header(pager);
+    pager_flush(pager, HEADER_PAGE_NUM);
+    pager_fsync(pager);
+
+    memset(pager->dirty_pages, 0, FILE_HEADER_CHANGED_PAGES_SIZE);
+    pager->file_length = (uint64_t)pager->num_pages * pager->page_size;
+}
+
+bool pager_page_changed(Pager* pager, uint32_t page_num) {
+    return pager->changed_pages[page_num / 8] & (1 << (page_num % 8));
+}
+
+// Like db_sync, the header goes last so a crash never leaves it ahead of the pages.
+void db_close(Database* database) {
+    Pager* pager = database->pager;
+
+    for(uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; ++i) {
+        if(pager->pages[i] == NULL) {
+            continue;
+        }
+
+        pager_flush(pager, i);
+        pager->pages[i] = NULL;
+    }
+    pager_fsync(pager);
+    pager_write_header(pager);
+    pager_flush(pager, HEADER_PAGE_NUM);
+    pager->pages[HEADER_PAGE_NUM] = NULL;
+    pager_fsync(pager);
+
+    int result = close(pager->file_descriptor);
+    if(result == -1) {
+        printf("Error closing db file\n");
+        exit(1);
+    }
+
+    free(pager->frames);
+    free(pager->changed_pages);
+    free(pager->dirty_pages);
+    free(pager);
+
+    for(uint32_t i = 0; i < database->num_tables; ++i) {
+        free(database->tables[i]);
+    }
+    free(database);
+}
+
+void pager_fsync(Pager* pager) {
+    if(fsync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(1);
+    }
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+    if(pager->pages[page_num] == NULL) {
+        printf("Tried to flush null page\n");
+        exit(1);
+    }
+
+    off_t offset = (off_t)page_num * pager->page_size;
+    ssize_t bytes_written = pwrite(pager->file_descriptor, pager->pages[page_num], pager->page_size, offset);
+
+    if(bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(1);
+    }
+
+    pager->stats.flushes++;
+    pager->stats.bytes_written += bytes_written;
+}
+
+/*
+    Copy the open database to path, page by page. Cached pages are copied
+    from memory so the backup includes changes not yet flushed; other pages
+    are read from the db file.
+
+    A full backup is written to <path>.tmp and renamed over path once it is
+    durable, so a failed backup leaves the previous one intact.
+
+    An incremental backup updates an existing backup in place and copies
+    only pages marked changed since that backup was taken. The backup must
+    carry this database's id and the generation of its last backup, so an
+    incremental backup onto any other file is refused. The header carries
+    the new generation, so it is written last, after the data pages are
+    synced.
+*/
+void backup_database(Database* database, const char* path, bool incremental, FILE* out) {
+    Pager* pager = database->pager;
+    uint32_t page_size = pager->page_size;
+
+    char* write_path = malloc(strlen(path) + 5);
+    sprintf(write_path, incremental ? "%s" : "%s.tmp", path);
+
+    // Both the target and the file actually written must not be the database
+    struct stat db_stat;
+    if(fstat(pager->file_descriptor, &db_stat) == 0 &&
+       (is_same_file(&db_stat, path) || is_same_file(&db_stat, write_path))) {
+        fprintf(out, "Error: Cannot back up the database onto itself\n");
+        free(write_path);
+        return;
+    }
+
+    int fd = open(write_path, incremental ? O_RDWR : (O_RDWR | O_CREAT | O_TRUNC), S_IWUSR | S_IRUSR);
+    if(fd == -1) {
+        fprintf(out, "Error: Unable to open backup file %s\n", write_path);
+        free(write_path);
+        return;
+    }
+
+    void* buffer = NULL;
+    if(posix_memalign(&buffer, page_size, page_size) != 0) {
+        fprintf(out, "Error: Unable to allocate %d bytes for backup\n", page_size);
+        close(fd);
+        if(!incremental) {
+            unlink(write_path);
+        }
+        free(write_path);
+        return;
+    }
+
+    if(incremental) {
+        ssize_t bytes_read = pread(fd, buffer, page_size, 0);
+        bool matches = bytes_read == page_size &&
+            memcmp(buffer + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE) == 0 &&
+            *file_header_version(buffer) == FILE_FORMAT_VERSION &&
+            *file_header_page_size(buffer) == page_size &&
+            *file_header_database_id(buffer) == *file_header_database_id(get_page(pager, HEADER_PAGE_NUM)) &&
+            *file_header_backup_generation(buffer) == pager->backup_generation;
+        if(!matches) {
+            fprintf(out, "Error: %s is not the latest backup of this database\n", path);
+            free(buffer);
+            close(fd);
+            free(write_path);
+            return;
+        }
+    }
+
+    uint32_t generation = pager->backup_generation + 1;
+    uint32_t pages_copied = 0;
+    bool ok = true;
+
+    for(uint32_t i = 0; i < pager->num_pages && ok; ++i) {
+        if(i == HEADER_PAGE_NUM || (incremental && !pager_page_changed(pager, i))) {
+            continue;
+        }
+        ok = backup_copy_page(pager, fd, i, buffer, generation);
+        pages_copied++;
+    }
+
+    // The header is rewritten every time, once the pages it describes are durable
+    ok = ok && fsync(fd) == 0 && backup_copy_page(pager, fd, HEADER_PAGE_NUM, buffer, generation);
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if(ok && !incremental) {
+        ok = rename(write_path, path) == 0;
+    }
+    if(!ok && !incremental) {
+        unlink(write_path);
+    }
+    free(buffer);
+    free(write_path);
+
+    if(!ok) {
+        fprintf(out, "Error: Unable to write backup file %s\n", path);
+        return;
+    }
+    pages_copied++;
+
+    // Only now that the backup is durable does it become the new baseline
+    pager->backup_generation = generation;
+    memset(pager->changed_pages, 0, FILE_HEADER_CHANGED_PAGES_SIZE);
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+
+    fprintf(out, "Copied %d of %d pages to %s\n", pages_copied, pager->num_pages, path);
+}
+
+bool is_same_file(struct stat* file_stat, const char* path) {
+    struct stat path_stat;
+    return stat(path, &path_stat) == 0 &&
+        file_stat->st_dev == path_stat.st_dev && file_stat->st_ino == path_stat.st_ino;
+}
+
+/*
+    Write one page of the open database to the backup. The header page gets
+    the backup's generation and an empty changed-page bitmap.
+*/
+bool backup_copy_page(Pager* pager, int fd, uint32_t page_num, void* buffer, uint32_t generation) {
+    uint32_t page_size = pager->page_size;
+    off_t offset = (off_t)page_num * page_size;
+
+    if(pager->pages[page_num]) {
+        memcpy(buffer, pager->pages[page_num], page_size);
+    } else if(pread(pager->file_descriptor, buffer, page_size, offset) != page_size) {
+        return false;
+    }
+
+    if(page_num == HEADER_PAGE_NUM) {
+        *file_header_version(buffer) = FILE_FORMAT_VERSION;
+        *file_header_page_count(buffer) = pager->num_pages;
+        *file_header_page_size(buffer) = page_size;
+        *file_header_backup_generation(buffer) = generation;
+        memset(file_header_changed_pages(buffer), 0, FILE_HEADER_CHANGED_PAGES_SIZE);
+    }
+
+    return pwrite(fd, buffer, page_size, offset) == page_size;
+}
+
+PrepareResult prepare_statement(InputBuffer* buffer, Statement* statement) {
+    if(strncmp(buffer->buffer, "insert", 6) == 0) { // Starts with 'insert'...followed by more
+       return prepare_insert(buffer, statement);
+    }
+
+    if(strncmp(buffer->buffer, "select", 6) == 0 && (buffer->buffer[6] == 0 || buffer->buffer[6] == ' ')) {
+        return prepare_select(buffer, statement);
+    }
+
+    if(strncmp(buffer->buffer, "create ", 7) == 0 || strncmp(buffer->buffer, "drop ", 5) == 0) {
+        return prepare_table_statement(buffer, statement);
+    }
+
+    return PREPARE_UNRECOGNIZED;
+}
+
+// This is our VM
+ExecuteResult execute_statement(Statement* statement, Database* database, FILE* out) {
+    if(statement->type == STATEMENT_CREATE_TABLE) {
+        return execute_create_table(statement, database);
+    }
+    if(statement->type == STATEMENT_DROP_TABLE) {
+        return execute_drop_table(statement, database);
+    }
+
+    Table* table = database_find_table(database, statement->table_name);
+    if(table == NULL) {
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+
+    uint64_t start = now_us();
+    ExecuteResult result;
+
+    // Only inserts and selects remain
+    if(statement->type == STATEMENT_INSERT) {
+        result = execute_insert(statement, table);
+        record_latency(&table->stats.insert_latency, now_us() - start);
+    } else {
+        result = execute_select(statement, table, out);
+        record_latency(&table->stats.select_latency, now_us() - start);
+    }
+    return result;
+}
+
+ExecuteResult execute_create_table(Statement* statement, Database* database) {
+    if(database_find_table(database, statement->table_name)) {
+        return EXECUTE_TABLE_EXISTS;
+    }
+    if(database->num_tables >= CATALOG_MAX_TABLES) {
+        return EXECUTE_CATALOG_FULL;
+    }
+
+    Pager* pager = database->pager;
+    if(pager_pages_available(pager) < 1) {
+        // No page left for the new root
+        return EXECUTE_DATABASE_FULL;
+    }
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void* root_node = get_page(pager, root_page_num);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    pager_mark_changed(pager, root_page_num);
+
+    catalog_add_table(get_page(pager, HEADER_PAGE_NUM), statement->table_name, root_page_num);
+    pager_mark_changed(pager, HEADER_PAGE_NUM);
+    database->tables[database->num_tables++] = table_open(pager, root_page_num);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+    Remove the catalog entry and put the table's pages on the free list for
+    the next table or split to reuse.
+*/
+ExecuteResult execute_drop_table(Statement* statement, Database* database) {
+    Pager* pager = database->pager;
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+
+    for(uint32_t i = 0; i < database->num_tables; ++i) {
+        if(strcmp(catalog_entry_name(catalog_entry(header, i)), statement->table_name) != 0) {
+            continue;
+        }
+
+        free_tree_pages(pager, database->tables[i]->root_page_num);
+        free(database->tables[i]);
+
+        // Keep entries and handles packed and in step
+        uint32_t num_after = database->num_tables - i - 1;
+        memmove(catalog_entry(header, i), catalog_entry(header, i + 1), num_after * CATALOG_ENTRY_SIZE);
+        memmove(&database->tables[i], &database->tables[i + 1], num_after * sizeof(Table*));
+        database->num_tables--;
+        *catalog_num_tables(header) = database->num_tables;
+        pager_mark_changed(pager, HEADER_PAGE_NUM);
+        return EXECUTE_SUCCESS;
+    }
+
+    return EXECUTE_NO_SUCH_TABLE;
+}
 
 ExecuteResult execute_insert(Statement* statement, Table* table){
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    Row* row_to_insert = &(statement->row_to_insert);
+    uint32_t key_to_insert = row_to_insert->id;
+    Cursor* cursor = table_find(table, key_to_insert);
+
+    if(cursor_holds_key(cursor, key_to_insert)) {
+        free(cursor);
+        return EXECUTE_DUPLICATE_KEY;
+    }
+    if(!leaf_insert_fits(cursor)) {
+        free(cursor);
+        return EXECUTE_TABLE_FULL;
+    }
+
+    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+    free(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table, FILE* out) {
+    Row row;
+
+    if(statement->select_by_id) {
+        // Single root-to-leaf descent
+        Cursor* cursor = table_find(table, statement->select_id);
+        bool limited_out = statement->has_limit && statement->limit == 0;
+        if(cursor_holds_key(cursor, statement->select_id) && !limited_out) {
+            deserialize_columns(cursor_value(cursor), &row, statement->columns);
+            print_projected_row(&row, statement->columns, out);
+        }
+        free(cursor);
+        return EXECUTE_SUCCESS;
+    }
+
+    if(statement->order_by != ORDER_NONE) {
+        if(statement->has_limit && statement->limit <= sort_memory_rows) {
+            return execute_select_top_n(statement, table, out);
+        }
+        return execute_select_sorted(statement, table, out);
+    }
+
+    return execute_select_scan(statement, table, out);
+}
+
+/*
+    Walk the leaves in order, evaluating the predicate a batch of cells at a
+    time on the serialized bytes. Only matching cells are deserialized, and
+    only the requested columns are copied out.
+*/
+ExecuteResult execute_select_scan(Statement* statement, Table* table, FILE* out) {
+    Cursor* cursor = table_start(table);
+    uint32_t page_num = cursor->page_num;
+    free(cursor);
+
+    Row row;
+    uint32_t printed = 0;
+    bool done = statement->has_limit && statement->limit == 0;
 
-    Row* row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
+    while(!done) {
+        void* node = get_page(table->pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
 
-    if(cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if(key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
+        for(uint32_t first = 0; first < num_cells && !done; first += PREDICATE_BATCH_SIZE) {
+            uint32_t batch = num_cells - first < PREDICATE_BATCH_SIZE ? num_cells - first : PREDICATE_BATCH_SIZE;
+            uint64_t matches = leaf_node_match_mask(node, first, batch, &statement->predicate);
+
+            while(matches && !done) {
+                uint32_t cell_num = first + __builtin_ctzll(matches);
+                matches &= matches - 1;
+
+                deserialize_columns(leaf_node_value(node, cell_num), &row, statement->columns);
+                print_projected_row(&row, statement->columns, out);
+                printed++;
+                done = statement->has_limit && printed >= statement->limit;
+            }
+        }
+
+        page_num = *leaf_node_next_leaf(node);
+        if(page_num == 0) {
+            break;
         }
     }
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    return EXECUTE_SUCCESS;
+}
+
+/*
+    ORDER BY ... LIMIT N: keep the best N rows seen so far in a heap whose
+    root is the worst of them, so memory is bounded by the limit.
+*/
+ExecuteResult execute_select_top_n(Statement* statement, Table* table, FILE* out) {
+    uint32_t limit = statement->limit;
+    uint32_t capacity = limit < SORT_BUFFER_INITIAL_ROWS ? (limit ? limit : 1) : SORT_BUFFER_INITIAL_ROWS;
+    Row* heap = malloc(sizeof(Row) * capacity);
+    uint32_t heap_len = 0;
+    Row row;
+
+    Cursor* cursor = table_start(table);
+    while(!(cursor->end_of_table) && limit > 0) {
+        void* value = cursor_value(cursor);
+        cursor_advance(cursor);
+        if(!cell_matches(value, &statement->predicate)) {
+            continue;
+        }
+        deserialize_row(value, &row);
 
+        if(heap_len < limit) {
+            if(heap_len == capacity) {
+                capacity = capacity * 2 < limit ? capacity * 2 : limit;
+                heap = realloc(heap, sizeof(Row) * capacity);
+            }
+            heap[heap_len] = row;
+            heap_sift_up(heap, heap_len, statement);
+            heap_len++;
+        } else if(compare_rows(&row, &heap[0], statement->order_by, statement->order_descending) < 0) {
+            heap[0] = row;
+            heap_sift_down(heap, heap_len, 0, statement);
+        }
+    }
     free(cursor);
 
+    qsort(heap, heap_len, sizeof(Row), row_comparator(statement->order_by, statement->order_descending));
+    for(uint32_t i = 0; i < heap_len; ++i) {
+        print_projected_row(&heap[i], statement->columns, out);
+    }
+
+    free(heap);
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    Cursor* cursor = table_start(table);
-    Row row;
+/*
+    ORDER BY without a (small) limit: external merge sort. Rows are buffered
+    up to sort_memory_rows, and each full buffer is sorted and spilled to a
+    temp file as a run. Runs are merged sort_merge_fan_in at a time as the
+    scan goes, then the rest are merged until one merge can stream straight
+    to the output.
+*/
+ExecuteResult execute_select_sorted(Statement* statement, Table* table, FILE* out) {
+    int (*comparator)(const void*, const void*) = row_comparator(statement->order_by, statement->order_descending);
+    uint32_t capacity = sort_memory_rows < SORT_BUFFER_INITIAL_ROWS ? sort_memory_rows : SORT_BUFFER_INITIAL_ROWS;
+    Row* buffer = malloc(sizeof(Row) * capacity);
+    uint32_t buffered = 0;
+    FILE** runs = NULL;
+    uint32_t* levels = NULL; // Merges each run has been through
+    uint32_t num_runs = 0;
 
+    Cursor* cursor = table_start(table);
     while(!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
+        void* value = cursor_value(cursor);
         cursor_advance(cursor);
+        if(!cell_matches(value, &statement->predicate)) {
+            continue;
+        }
+        if(buffered == capacity) {
+            // Only as much memory as the rows need, up to the budget
+            capacity = capacity * 2 < sort_memory_rows ? capacity * 2 : sort_memory_rows;
+            buffer = realloc(buffer, sizeof(Row) * capacity);
+        }
+        deserialize_row(value, &buffer[buffered++]);
+
+        if(buffered == sort_memory_rows) {
+            qsort(buffer, buffered, sizeof(Row), comparator);
+            runs = realloc(runs, sizeof(FILE*) * (num_runs + 1));
+            levels = realloc(levels, sizeof(uint32_t) * (num_runs + 1));
+            num_runs = add_sort_run(runs, levels, num_runs, spill_run(buffer, buffered), statement);
+            table->stats.sort_runs_spilled++;
+            buffered = 0;
+        }
     }
-
     free(cursor);
 
+    qsort(buffer, buffered, sizeof(Row), comparator);
+
+    if(num_runs == 0) {
+        // Everything fit in memory
+        for(uint32_t i = 0; i < buffered && !(statement->has_limit && i >= statement->limit); ++i) {
+            print_projected_row(&buffer[i], statement->columns, out);
+        }
+        free(buffer);
+        return EXECUTE_SUCCESS;
+    }
+
+    if(buffered > 0) {
+        runs = realloc(runs, sizeof(FILE*) * (num_runs + 1));
+        levels = realloc(levels, sizeof(uint32_t) * (num_runs + 1));
+        num_runs = add_sort_run(runs, levels, num_runs, spill_run(buffer, buffered), statement);
+        table->stats.sort_runs_spilled++;
+    }
+    free(buffer);
+    free(levels);
+
+    while(num_runs > sort_merge_fan_in) {
+        uint32_t num_merged = 0;
+        for(uint32_t i = 0; i < num_runs; i += sort_merge_fan_in) {
+            uint32_t group = (num_runs - i < sort_merge_fan_in) ? num_runs - i : sort_merge_fan_in;
+            FILE* merged = new_sort_run();
+            merge_runs(runs + i, group, statement, merged, NULL);
+            rewind(merged);
+            runs[num_merged++] = merged;
+        }
+        num_runs = num_merged;
+    }
+
+    merge_runs(runs, num_runs, statement, NULL, out);
+    free(runs);
+
     return EXECUTE_SUCCESS;
 }
 
-void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+/*
+    Orders by the given column, then by id so equal values sort stably.
+*/
+int compare_rows(const Row* a, const Row* b, OrderColumn column, bool descending) {
+    int result = 0;
+    switch(column) {
+    case ORDER_BY_USERNAME:
+        result = strcmp(a->username, b->username);
+        break;
+    case ORDER_BY_EMAIL:
+        result = strcmp(a->email, b->email);
+        break;
+    case ORDER_NONE:
+        break;
+    }
+    if(result == 0) {
+        result = (a->id > b->id) - (a->id < b->id);
+    }
+    return descending ? -result : result;
+}
+
+int compare_rows_username_asc(const void* a, const void* b) {
+    return compare_rows(a, b, ORDER_BY_USERNAME, false);
+}
+
+int compare_rows_username_desc(const void* a, const void* b) {
+    return compare_rows(a, b, ORDER_BY_USERNAME, true);
+}
+
+int compare_rows_email_asc(const void* a, const void* b) {
+    return compare_rows(a, b, ORDER_BY_EMAIL, false);
+}
+
+int compare_rows_email_desc(const void* a, const void* b) {
+    return compare_rows(a, b, ORDER_BY_EMAIL, true);
+}
+
+/*
+    qsort has no context argument, so pick a comparator per column and direction.
+*/
+int (*row_comparator(OrderColumn column, bool descending))(const void*, const void*) {
+    if(column == ORDER_BY_EMAIL) {
+        return descending ? compare_rows_email_desc : compare_rows_email_asc;
+    }
+    return descending ? compare_rows_username_desc : compare_rows_username_asc;
+}
+
+// Max-heap on sort order: heap[0] is the row that would be printed last.
+void heap_sift_up(Row* heap, uint32_t index, Statement* statement) {
+    while(index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if(compare_rows(&heap[index], &heap[parent], statement->order_by, statement->order_descending) <= 0) {
+            return;
+        }
+        Row tmp = heap[index];
+        heap[index] = heap[parent];
+        heap[parent] = tmp;
+        index = parent;
+    }
+}
+
+void heap_sift_down(Row* heap, uint32_t len, uint32_t index, Statement* statement) {
+    while(true) {
+        uint32_t largest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+        if(left < len && compare_rows(&heap[left], &heap[largest], statement->order_by, statement->order_descending) > 0) {
+            largest = left;
+        }
+        if(right < len && compare_rows(&heap[right], &heap[largest], statement->order_by, statement->order_descending) > 0) {
+            largest = right;
+        }
+        if(largest == index) {
+            return;
+        }
+        Row tmp = heap[index];
+        heap[index] = heap[largest];
+        heap[largest] = tmp;
+        index = largest;
+    }
+}
+
+FILE* new_sort_run() {
+    FILE* run = tmpfile();
+    if(run == NULL) {
+        printf("Unable to create temp file for sort: %d\n", errno);
+        exit(1);
+    }
+    return run;
+}
+
+FILE* spill_run(Row* rows, uint32_t num_rows) {
+    FILE* run = new_sort_run();
+    if(fwrite(rows, sizeof(Row), num_rows, run) != num_rows) {
+        printf("Error writing sort run: %d\n", errno);
+        exit(1);
+    }
+    rewind(run);
+    return run;
+}
+
+/*
+    Append a run at level 0. Whenever the last sort_merge_fan_in runs share
+    a level they are merged into one run a level up, so the open temp files
+    grow with the number of levels rather than with the table. Levels only
+    decrease along the array, so checking the first and last of those runs
+    is enough. Returns the new number of runs.
+*/
+uint32_t add_sort_run(FILE** runs, uint32_t* levels, uint32_t num_runs, FILE* run, Statement* statement) {
+    runs[num_runs] = run;
+    levels[num_runs] = 0;
+    num_runs++;
+
+    while(num_runs >= sort_merge_fan_in && levels[num_runs - sort_merge_fan_in] == levels[num_runs - 1]) {
+        uint32_t first = num_runs - sort_merge_fan_in;
+        FILE* merged = new_sort_run();
+        merge_runs(runs + first, sort_merge_fan_in, statement, merged, NULL);
+        rewind(merged);
+        runs[first] = merged;
+        levels[first]++;
+        num_runs = first + 1;
+    }
+    return num_runs;
+}
+
+/*
+    Merge sorted runs, closing them. Rows go to run_out if given, otherwise
+    they are printed to out, stopping at the statement's limit.
+*/
+void merge_runs(FILE** runs, uint32_t num_runs, Statement* statement, FILE* run_out, FILE* out) {
+    Row* heads = malloc(sizeof(Row) * num_runs);
+    bool* has_head = malloc(sizeof(bool) * num_runs);
+    for(uint32_t i = 0; i < num_runs; ++i) {
+        has_head[i] = fread(&heads[i], sizeof(Row), 1, runs[i]) == 1;
+    }
+
+    uint64_t emitted = 0;
+    while(!(run_out == NULL && statement->has_limit && emitted >= statement->limit)) {
+        int32_t min = -1;
+        for(uint32_t i = 0; i < num_runs; ++i) {
+            if(has_head[i] && (min == -1 ||
+               compare_rows(&heads[i], &heads[min], statement->order_by, statement->order_descending) < 0)) {
+                min = i;
+            }
+        }
+        if(min == -1) {
+            break;
+        }
+
+        if(run_out) {
+            if(fwrite(&heads[min], sizeof(Row), 1, run_out) != 1) {
+                printf("Error writing sort run: %d\n", errno);
+                exit(1);
+            }
+        } else {
+            print_projected_row(&heads[min], statement->columns, out);
+        }
+        emitted++;
+        has_head[min] = fread(&heads[min], sizeof(Row), 1, runs[min]) == 1;
+    }
+
+    for(uint32_t i = 0; i < num_runs; ++i) {
+        fclose(runs[i]);
+    }
+    free(heads);
+    free(has_head);
+}
+
+void print_row(Row* row, FILE* out) {
+    print_projected_row(row, COLUMN_ALL, out);
+}
+
+void print_projected_row(Row* row, uint32_t columns, FILE* out) {
+    const char* separator = "";
+    fputc('(', out);
+    if(columns & COLUMN_ID) {
+        fprintf(out, "%d", row->id);
+        separator = ", ";
+    }
+    if(columns & COLUMN_USERNAME) {
+        fprintf(out, "%s%s", separator, row->username);
+        separator = ", ";
+    }
+    if(columns & COLUMN_EMAIL) {
+        fprintf(out, "%s%s", separator, row->email);
+    }
+    fputs(")\n", out);
 }
 
 void serialize_row(Row* source, void* destination) {
@@ -821,6 +2627,123 @@ void deserialize_row(void* source, Row* destination) {
     memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
+// Like deserialize_row, but only copies the requested columns.
+void deserialize_columns(void* source, Row* destination, uint32_t columns) {
+    if(columns & COLUMN_ID) {
+        memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+    }
+    if(columns & COLUMN_USERNAME) {
+        memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+    }
+    if(columns & COLUMN_EMAIL) {
+        memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    }
+}
+
+/*
+    Compare the first PREDICATE_HEAD_SIZE bytes of a column against the
+    needle in one step; only the first match_len of them have to agree.
+    Columns are at least that wide, and the needle is zero padded, so both
+    loads stay in bounds.
+*/
+bool column_head_matches(const char* column, Predicate* predicate) {
+    uint32_t head_len = predicate->match_len < PREDICATE_HEAD_SIZE ? predicate->match_len : PREDICATE_HEAD_SIZE;
+#if defined(__SSE2__)
+    __m128i a = _mm_loadu_si128((const __m128i*)column);
+    __m128i b = _mm_loadu_si128((const __m128i*)predicate->needle);
+    uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    uint32_t head_mask = (1u << head_len) - 1;
+    return (equal & head_mask) == head_mask;
+#else
+    // Two 64-bit words at a time; a zero byte in the xor means equal
+    for(uint32_t i = 0; i < head_len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, column + i, 8);
+        memcpy(&b, predicate->needle + i, 8);
+        uint64_t diff = a ^ b;
+        uint32_t bytes = head_len - i < 8 ? head_len - i : 8;
+        if(bytes < 8) {
+            // Keep the first bytes in memory order regardless of endianness
+            uint64_t keep;
+            memset(&keep, 0, sizeof(keep));
+            memset(&keep, 0xff, bytes);
+            diff &= keep;
+        }
+        if(diff) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+/*
+    Evaluate a predicate against a serialized row. PREDICATE_NONE matches everything.
+*/
+bool cell_matches(void* value, Predicate* predicate) {
+    const char* column = (const char*)value + predicate->column_offset;
+    switch(predicate->op) {
+    case PREDICATE_NONE:
+        return true;
+    case PREDICATE_EQUALS:
+    case PREDICATE_PREFIX:
+        if(!column_head_matches(column, predicate)) {
+            return false;
+        }
+        return predicate->match_len <= PREDICATE_HEAD_SIZE ||
+               memcmp(column + PREDICATE_HEAD_SIZE, predicate->needle + PREDICATE_HEAD_SIZE,
+                      predicate->match_len - PREDICATE_HEAD_SIZE) == 0;
+    case PREDICATE_CONTAINS:
+        return memmem(column, strnlen(column, predicate->column_size),
+                      predicate->needle, predicate->needle_len) != NULL;
+    }
+    return false;
+}
+
+/*
+    Bit i is set if cell first + i of the leaf matches. num_cells is at most
+    PREDICATE_BATCH_SIZE.
+*/
+uint64_t leaf_node_match_mask(void* node, uint32_t first_cell, uint32_t num_cells, Predicate* predicate) {
+    uint64_t all = num_cells == 64 ? ~0ULL : (1ULL << num_cells) - 1;
+    if(predicate->op == PREDICATE_NONE) {
+        return all;
+    }
+
+    uint64_t mask = 0;
+    for(uint32_t i = 0; i < num_cells; ++i) {
+        mask |= (uint64_t)cell_matches(leaf_node_value(node, first_cell + i), predicate) << i;
+    }
+    return mask;
+}
+
+/*
+    Internal nodes can't split yet and the pager holds at most
+    TABLE_MAX_PAGES pages, so check that an insert at cursor fits before
+    starting a split that could not finish.
+*/
+bool leaf_insert_fits(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    void* node = get_page(pager, cursor->page_num);
+    if(*leaf_node_num_cells(node) < leaf_node_max_cells(pager->page_size)) {
+        return true;
+    }
+    if(is_node_root(node)) {
+        // New sibling plus the page the old root moves to
+        return pager_pages_available(pager) >= 2;
+    }
+    void* parent = get_page(pager, *node_parent(node));
+    return *internal_node_num_keys(parent) < INTERNAL_NODE_MAX_CELLS && pager_pages_available(pager) >= 1;
+}
+
+/*
+    True if the cell under cursor (as positioned by table_find) has the given key.
+*/
+bool cursor_holds_key(Cursor* cursor, uint32_t key) {
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    return cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key;
+}
+
 void* cursor_value(Cursor* cursor) {
     uint32_t page_num = cursor->page_num;
     void* page = get_page(cursor->table->pager, page_num);
@@ -848,45 +2771,93 @@ void print_prompt() {
     printf("db > ");
 }
 
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
+Database* db_open(const char* filename, uint32_t page_size, uint32_t pager_flags) {
+    Pager* pager = pager_open(filename, page_size, pager_flags);
 
-    Table* table = (Table*)malloc(sizeof(Table));
-    table->pager = pager;
+    Database* database = (Database*)malloc(sizeof(Database));
+    database->pager = pager;
+    database->num_tables = 0;
 
-    if(pager->num_pages == 0) {
-        // New db file. Initialize page 0 as leaf node
-        void* root_node = get_page(pager, 0);
+    bool new_file = pager->num_pages == 0;
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+
+    if(new_file) {
+        // New db file. Write the header and a users table rooted at page 1
+        initialize_file_header(header, pager->page_size);
+        void* root_node = get_page(pager, DEFAULT_TABLE_ROOT_PAGE_NUM);
+        pager_mark_changed(pager, DEFAULT_TABLE_ROOT_PAGE_NUM);
         initialize_leaf_node(root_node);
         set_node_root(root_node, true);
+        catalog_add_table(header, DEFAULT_TABLE_NAME, DEFAULT_TABLE_ROOT_PAGE_NUM);
+    } else if(*file_header_version(header) < 4) {
+        // Older files hold just the users table; give them a catalog saying so
+        *file_header_free_page_head(header) = 0;
+        *file_header_database_id(header) = new_database_id();
+        *catalog_num_tables(header) = 0;
+        catalog_add_table(header, DEFAULT_TABLE_NAME, DEFAULT_TABLE_ROOT_PAGE_NUM);
+        pager_mark_changed(pager, HEADER_PAGE_NUM);
+    } else if(*file_header_version(header) == 4) {
+        // Move the catalog up to make room for the database id
+        memmove(header + CATALOG_NUM_TABLES_OFFSET, header + FILE_HEADER_DATABASE_ID_OFFSET,
+                CATALOG_HEADER_SIZE + CATALOG_MAX_TABLES * CATALOG_ENTRY_SIZE);
+        *file_header_database_id(header) = new_database_id();
+        pager_mark_changed(pager, HEADER_PAGE_NUM);
+    }
+
+    if(*catalog_num_tables(header) > CATALOG_MAX_TABLES) {
+        printf("Db file catalog has %d tables. Corrupt file\n", *catalog_num_tables(header));
+        exit(1);
+    }
+    for(uint32_t i = 0; i < *catalog_num_tables(header); ++i) {
+        uint32_t root_page_num = *catalog_entry_root_page(catalog_entry(header, i));
+        if(root_page_num == HEADER_PAGE_NUM || root_page_num >= pager->num_pages) {
+            printf("Db file catalog points at page %d of %d. Corrupt file\n", root_page_num, pager->num_pages);
+            exit(1);
+        }
+        database->tables[database->num_tables++] = table_open(pager, root_page_num);
     }
 
+    return database;
+}
+
+Table* table_open(Pager* pager, uint32_t root_page_num) {
+    Table* table = (Table*)malloc(sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = root_page_num;
+    memset(&table->stats, 0, sizeof(TableStats));
     return table;
 }
 
+Table* database_find_table(Database* database, const char* name) {
+    void* header = get_page(database->pager, HEADER_PAGE_NUM);
+    for(uint32_t i = 0; i < database->num_tables; ++i) {
+        if(strcmp(catalog_entry_name(catalog_entry(header, i)), name) == 0) {
+            return database->tables[i];
+        }
+    }
+    return NULL;
+}
+
 void* get_page(Pager* pager, uint32_t page_num) {
-    if(page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+    if(page_num >= TABLE_MAX_PAGES) {
+        printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
         exit(1);
     }
 
     if(pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        // We might save a partial page at the end of the file
-        if( pager->file_length  % PAGE_SIZE) {
-            num_pages ++;
-        }
-
-        if(page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+        // Cache miss. Load into this page's frame.
+        pager->stats.page_misses++;
+        void* page = pager->frames + (size_t)page_num * pager->page_size;
+        uint64_t num_pages = pager->file_length / pager->page_size;
+
+        if(page_num < num_pages) {
+            off_t offset = (off_t)page_num * pager->page_size;
+            ssize_t bytes_read = pread(pager->file_descriptor, page, pager->page_size, offset);
             if(bytes_read == -1) {
                 printf("Error reading file: %d\n", errno);
                 exit(1);
             }
+            pager->stats.bytes_read += bytes_read;
         }
 
         pager->pages[page_num] = page;
@@ -894,6 +2865,8 @@ void* get_page(Pager* pager, uint32_t page_num) {
         if(page_num >= pager->num_pages) {
             pager->num_pages = page_num + 1;
         }
+    } else {
+        pager->stats.page_hits++;
     }
 
     return pager->pages[page_num];
@@ -918,3 +2891,287 @@ InputBuffer* new_input_buffer() {
     in->input_len = 0;
     return in;
 }
+
+/*
+    Server mode
+
+    Wire protocol (both directions): a uint32_t length in host byte order
+    followed by that many bytes. A request carries one statement or meta
+    command, without the trailing newline. The response carries exactly
+    what the REPL would have printed for it. ".exit" closes the connection.
+*/
+volatile sig_atomic_t server_stop_requested = 0;
+
+void handle_server_signal(int) {
+    server_stop_requested = 1;
+}
+
+void run_server(Database* database, const char* socket_path) {
+    Server server;
+    server.database = database;
+    server.queue = malloc(sizeof(int) * SERVER_MAX_CONNECTIONS);
+    server.queue_head = 0;
+    server.queue_len = 0;
+    server.shutting_down = false;
+    pthread_mutex_init(&server.database_lock, NULL);
+    pthread_mutex_init(&server.queue_lock, NULL);
+    pthread_cond_init(&server.queue_ready, NULL);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server.listen_fd == -1) {
+        printf("Error creating socket: %d\n", errno);
+        exit(1);
+    }
+    if(bind(server.listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        printf("Error binding socket: %d\n", errno);
+        exit(1);
+    }
+    if(listen(server.listen_fd, SERVER_MAX_CONNECTIONS) == -1) {
+        printf("Error listening on socket: %d\n", errno);
+        exit(1);
+    }
+
+    if(pipe(server.wake_pipe) == -1) {
+        printf("Error creating pipe: %d\n", errno);
+        exit(1);
+    }
+    fcntl(server.wake_pipe[0], F_SETFL, O_NONBLOCK);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_server_signal);
+    signal(SIGTERM, handle_server_signal);
+
+    // Workers inherit a blocked mask so shutdown signals always interrupt poll
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    pthread_t* workers = malloc(sizeof(pthread_t) * SERVER_NUM_WORKERS);
+    for(uint32_t i = 0; i < SERVER_NUM_WORKERS; ++i) {
+        pthread_create(&workers[i], NULL, server_worker, &server);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    /*
+        Slot 0 is the listening socket, slot 1 the wake pipe, the rest are
+        client connections. A connection owned by a worker has fd -1 so
+        poll ignores it until it is handed back.
+    */
+    uint32_t num_fds = SERVER_MAX_CONNECTIONS + 2;
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * num_fds);
+    for(uint32_t i = 0; i < num_fds; ++i) {
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+    }
+    fds[0].fd = server.listen_fd;
+    fds[1].fd = server.wake_pipe[0];
+    uint32_t num_connections = 0;
+
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    while(!server_stop_requested) {
+        if(poll(fds, num_fds, -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            printf("Error polling: %d\n", errno);
+            exit(1);
+        }
+
+        if(fds[0].revents & POLLIN) {
+            int client_fd = accept(server.listen_fd, NULL, NULL);
+            if(client_fd != -1 && num_connections >= SERVER_MAX_CONNECTIONS) {
+                close(client_fd);
+            } else if(client_fd != -1) {
+                // Bound how long a worker can block on one slow client
+                struct timeval timeout = { SERVER_IO_TIMEOUT_SECONDS, 0 };
+                setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                for(uint32_t i = 2; i < num_fds; ++i) {
+                    if(fds[i].fd == -1) {
+                        fds[i].fd = client_fd;
+                        break;
+                    }
+                }
+                num_connections++;
+            }
+        }
+
+        if(fds[1].revents & POLLIN) {
+            ServerHandoff handoff;
+            while(read(server.wake_pipe[0], &handoff, sizeof(handoff)) == sizeof(handoff)) {
+                if(!handoff.keep_open) {
+                    num_connections--;
+                    continue;
+                }
+                for(uint32_t i = 2; i < num_fds; ++i) {
+                    if(fds[i].fd == -1) {
+                        fds[i].fd = handoff.fd;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for(uint32_t i = 2; i < num_fds; ++i) {
+            if(fds[i].fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            pthread_mutex_lock(&server.queue_lock);
+            uint32_t tail = (server.queue_head + server.queue_len) % SERVER_MAX_CONNECTIONS;
+            server.queue[tail] = fds[i].fd;
+            server.queue_len++;
+            pthread_cond_signal(&server.queue_ready);
+            pthread_mutex_unlock(&server.queue_lock);
+
+            fds[i].fd = -1;
+        }
+    }
+
+    pthread_mutex_lock(&server.queue_lock);
+    server.shutting_down = true;
+    pthread_cond_broadcast(&server.queue_ready);
+    pthread_mutex_unlock(&server.queue_lock);
+
+    for(uint32_t i = 0; i < SERVER_NUM_WORKERS; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for(uint32_t i = 2; i < num_fds; ++i) {
+        if(fds[i].fd != -1) {
+            close(fds[i].fd);
+        }
+    }
+    close(server.listen_fd);
+    close(server.wake_pipe[0]);
+    close(server.wake_pipe[1]);
+    unlink(socket_path);
+
+    free(fds);
+    free(workers);
+    free(server.queue);
+    pthread_cond_destroy(&server.queue_ready);
+    pthread_mutex_destroy(&server.queue_lock);
+    pthread_mutex_destroy(&server.database_lock);
+}
+
+void* server_worker(void* arg) {
+    Server* server = arg;
+
+    while(true) {
+        pthread_mutex_lock(&server->queue_lock);
+        while(server->queue_len == 0 && !server->shutting_down) {
+            pthread_cond_wait(&server->queue_ready, &server->queue_lock);
+        }
+        if(server->shutting_down) {
+            pthread_mutex_unlock(&server->queue_lock);
+            return NULL;
+        }
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVER_MAX_CONNECTIONS;
+        server->queue_len--;
+        pthread_mutex_unlock(&server->queue_lock);
+
+        ServerHandoff handoff;
+        handoff.fd = fd;
+        handoff.keep_open = server_handle_request(server, fd);
+        if(!handoff.keep_open) {
+            close(fd);
+        }
+        write(server->wake_pipe[1], &handoff, sizeof(handoff));
+    }
+}
+
+/*
+    Answer one request on fd. Returns false if the connection should be closed.
+*/
+bool server_handle_request(Server* server, int fd) {
+    uint32_t request_len;
+    if(!read_fully(fd, &request_len, sizeof(request_len))) {
+        return false;
+    }
+    if(request_len == 0 || request_len > SERVER_MAX_REQUEST_SIZE) {
+        return false;
+    }
+
+    InputBuffer* input = new_input_buffer();
+    input->buffer = malloc(request_len + 1);
+    input->buffer_len = request_len + 1;
+    input->input_len = request_len;
+    if(!read_fully(fd, input->buffer, request_len)) {
+        free(input->buffer);
+        free(input);
+        return false;
+    }
+    input->buffer[request_len] = 0;
+
+    if(strcmp(input->buffer, ".exit") == 0) {
+        free(input->buffer);
+        free(input);
+        return false;
+    }
+
+    char* response = NULL;
+    size_t response_len = 0;
+    FILE* out = open_memstream(&response, &response_len);
+
+    // Writes reach the db file before the client sees its response
+    pthread_mutex_lock(&server->database_lock);
+    execute_input(input, server->database, out);
+    db_sync(server->database);
+    pthread_mutex_unlock(&server->database_lock);
+
+    fclose(out);
+    free(input->buffer);
+    free(input);
+
+    uint32_t length = response_len;
+    bool ok = write_fully(fd, &length, sizeof(length)) && write_fully(fd, response, response_len);
+    free(response);
+    return ok;
+}
+
+bool read_fully(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t bytes_read = read(fd, (char*)buffer + done, length - done);
+        if(bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if(bytes_read <= 0) {
+            return false;
+        }
+        done += bytes_read;
+    }
+    return true;
+}
+
+bool write_fully(int fd, const void* buffer, size_t length) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t bytes_written = write(fd, (const char*)buffer + done, length - done);
+        if(bytes_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if(bytes_written <= 0) {
+            return false;
+        }
+        done += bytes_written;
+    }
+    return true;
+}